@@ -5,12 +5,13 @@ ROOT="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
 if [[ $# -eq 0 ]]
 then
     HARNESS_DIR=harness
+    UTILS_DIR=utilities
     APP_DIRS="img-dnn masstree moses shore silo specjbb sphinx xapian"
 else
     APP_DIRS=$@
 fi
 
-for dir in ${HARNESS_DIR} ${APP_DIRS}
+for dir in ${HARNESS_DIR} ${UTILS_DIR} ${APP_DIRS}
 do
     echo "Building $dir"
     cd ${ROOT}/${dir}
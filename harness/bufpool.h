@@ -0,0 +1,75 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __BUFPOOL_H
+#define __BUFPOOL_H
+
+#include "mpmc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Pool of variable-length message buffers in power-of-2 size classes, safe to
+// allocate from and release to from any thread. Buffers are recycled instead
+// of going back to malloc, so the hot path never allocates or page-faults once
+// the pool is warm. Each buffer carries its size class in a small prefix, so
+// release() needs only the pointer. Memory is never zeroed; the untouched tail
+// of a large buffer costs address space, not RAM.
+class BufPool {
+    private:
+        static const int MIN_CLASS = 6;  // 64 B
+        static const int MAX_CLASS = 22; // 4 MB
+        static const size_t PREFIX = 16; // Keeps buffers 16 B aligned
+
+        MpmcQueue<char*>* freeLists[MAX_CLASS + 1];
+
+        static int classOf(size_t len) {
+            int c = MIN_CLASS;
+            while (c < MAX_CLASS && (static_cast<size_t>(1) << c) < len) ++c;
+            return c;
+        }
+
+    public:
+        BufPool(size_t buffersPerClass = 1024) {
+            for (int c = 0; c <= MAX_CLASS; ++c) {
+                freeLists[c] = (c >= MIN_CLASS) ?
+                    new MpmcQueue<char*>(buffersPerClass) : nullptr;
+            }
+        }
+
+        char* alloc(size_t len) {
+            int c = classOf(len);
+            if (len > (static_cast<size_t>(1) << c)) abort(); // Too large
+
+            char* base;
+            if (!freeLists[c]->pop(&base)) {
+                base = reinterpret_cast<char*>(
+                        malloc(PREFIX + (static_cast<size_t>(1) << c)));
+                *reinterpret_cast<int*>(base) = c;
+            }
+
+            return base + PREFIX;
+        }
+
+        void release(char* buf) {
+            if (!buf) return;
+            char* base = buf - PREFIX;
+            int c = *reinterpret_cast<int*>(base);
+            if (!freeLists[c]->push(base)) free(base); // Pool is full
+        }
+};
+
+#endif
@@ -27,13 +27,17 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <queue>
 #include <sstream>
 #include <string>
 
@@ -41,25 +45,290 @@
  * Client
  *******************************************************************************/
 
+// Index into Client::threadStates for the calling thread, assigned on its first
+// call to startReq()
+static __thread int clientTid = -1;
+
+// Latency stats of the calling thread, allocated on its first call to finiReq()
+static __thread LatStats* threadLatStats = nullptr;
+
+// Request classes, set through tBenchClientSetReqClass(). Apps call it from
+// tBenchClientGenReq(), which runs under Client::genLock, so one pending tag
+// serves all threads.
+static unsigned genReqClass = 0;
+static std::atomic<bool> reqClassesUsed(false);
+static std::string reqClassNames[TBENCH_MAX_REQ_CLASSES];
+
+// Derive well-separated per-thread seeds from the user-provided seed. Seeding
+// LCG engines with adjacent values gives strongly correlated streams, so the
+// (seed, tid) pair is run through a splitmix64 finalizer first
+static uint64_t threadSeed(uint64_t seed, int tid) {
+    uint64_t z = seed + (tid + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Parses a TBENCH_RAMP spec of the form "sec:qps,sec:qps,..."
+static std::vector<std::pair<double, double>> parseRamp(const std::string& spec) {
+    std::vector<std::pair<double, double>> points;
+    std::stringstream ss(spec);
+    std::string item;
+
+    while (std::getline(ss, item, ',')) {
+        std::stringstream is(item);
+        double sec, qps;
+        char sep;
+        if (!(is >> sec >> sep >> qps) || sep != ':' || qps < 0 ||
+                (!points.empty() && sec <= points.back().first)) {
+            std::cerr << "Invalid TBENCH_RAMP point '" << item << "'" \
+                << std::endl;
+            exit(-1);
+        }
+        points.push_back(std::make_pair(sec, qps));
+    }
+
+    if (points.empty() || points.back().second <= 0) {
+        std::cerr << "TBENCH_RAMP must end at a nonzero QPS" << std::endl;
+        exit(-1);
+    }
+
+    return points;
+}
+
+// lambda is this process's share of the load. Trace replay is striped across
+// processes instead, and ramp rates are scaled down by nprocs.
+static Dist* createDist(double lambda, uint64_t startNs, int rank, int nprocs) {
+    std::string type = getOpt<std::string>("TBENCH_ARRIVAL_DIST", "exp");
+
+    if (type == "exp") {
+        return new ExpDist(lambda, startNs);
+    } else if (type == "det") {
+        return new DetDist(lambda, startNs);
+    } else if (type == "pareto") {
+        double shape = getOpt<double>("TBENCH_PARETO_SHAPE", 2.5);
+        if (shape <= 1.0) {
+            std::cerr << "TBENCH_PARETO_SHAPE must be > 1" << std::endl;
+            exit(-1);
+        }
+        return new ParetoDist(lambda, shape, startNs);
+    } else if (type == "lognormal") {
+        double sigma = getOpt<double>("TBENCH_LOGNORMAL_SIGMA", 1.0);
+        return new LognormalDist(lambda, sigma, startNs);
+    } else if (type == "mmpp") {
+        double burst = getOpt<double>("TBENCH_MMPP_BURST", 10.0);
+        double onNs = getOpt<double>("TBENCH_MMPP_ON_MS", 10.0) * 1e6;
+        double offNs = getOpt<double>("TBENCH_MMPP_OFF_MS", 90.0) * 1e6;
+        if (burst < 1.0 || onNs <= 0 || offNs <= 0) {
+            std::cerr << "Invalid MMPP parameters" << std::endl;
+            exit(-1);
+        }
+        return new MmppDist(lambda, burst, onNs, offNs, startNs);
+    } else if (type == "ramp") {
+        std::string spec = getOpt<std::string>("TBENCH_RAMP", "");
+        auto points = parseRamp(spec);
+        for (auto& p : points) p.second /= nprocs;
+        return new RampDist(points, startNs);
+    } else if (type == "trace") {
+        std::string file = getOpt<std::string>("TBENCH_ARRIVAL_TRACE", "");
+        return new TraceDist(file, startNs, rank, nprocs);
+    }
+
+    std::cerr << "Unknown TBENCH_ARRIVAL_DIST " << type << std::endl;
+    exit(-1);
+}
+
+static uint64_t drawThinkNs(double meanNs, DistGen& g) {
+    if (meanNs <= 0) return 0;
+    std::exponential_distribution<double> think(1.0 / meanNs);
+    return think(g);
+}
+
 Client::Client(int _nthreads) {
     status = INIT;
 
     nthreads = _nthreads;
     pthread_mutex_init(&lock, nullptr);
+    pthread_mutex_init(&genLock, nullptr);
     pthread_barrier_init(&barrier, nullptr, nthreads);
+    Clock::get(); // Calibrate before the first request is stamped
     
     minSleepNs = getOpt("TBENCH_MINSLEEPNS", 0);
     seed = getOpt("TBENCH_RANDSEED", 0);
     lambda = getOpt<double>("TBENCH_QPS", 1000.0) * 1e-9;
 
+    nprocs = getOpt<int>("TBENCH_CLIENT_PROCS", 1);
+    rank = getOpt<int>("TBENCH_CLIENT_RANK", 0);
+    statsDir = getOpt<std::string>("TBENCH_STATS_DIR", ".");
+    if (nprocs < 1 || rank < 0 || rank >= nprocs) {
+        std::cerr << "Invalid TBENCH_CLIENT_RANK " << rank << " for " \
+            << nprocs << " client processes" << std::endl;
+        exit(-1);
+    }
+
+    // Independent Poisson streams superpose into a Poisson stream, so each
+    // process runs at 1/nprocs of the rate on its own seeds
+    lambda /= nprocs;
+    seed = threadSeed(seed, -1 - rank);
+
     dist = nullptr; // Will get initialized in startReq()
 
-    startedReqs = 0;
+    std::string modeStr = getOpt<std::string>("TBENCH_LOAD_MODE", "open");
+    sloNs = getOpt<double>("TBENCH_SLO_US", 0.0) * 1e3;
+    pthread_mutex_init(&usersLock, nullptr);
+    pthread_cond_init(&usersReady, nullptr);
+    usersGen.seed(threadSeed(seed, -1));
+    thinkNs = 0.0;
+    continueProb = 0.0;
+    nextOpenNs = 0;
+    closedUsers = 0;
+    userConns = 1;
+
+    if (modeStr == "open") {
+        mode = OPEN_LOOP;
+    } else if (modeStr == "closed") {
+        mode = CLOSED_LOOP;
+        closedUsers = getOpt<int>("TBENCH_CLOSED_USERS", 1);
+        thinkNs = getOpt<double>("TBENCH_THINK_US", 0.0) * 1e3;
+        if (closedUsers < 1) {
+            std::cerr << "TBENCH_CLOSED_USERS must be >= 1" << std::endl;
+            exit(-1);
+        }
+    } else if (modeStr == "mixed") {
+        mode = PARTLY_OPEN;
+        double sessionReqs = getOpt<double>("TBENCH_SESSION_REQS", 10.0);
+        thinkNs = getOpt<double>("TBENCH_THINK_US", 0.0) * 1e3;
+        if (sessionReqs < 1.0) {
+            std::cerr << "TBENCH_SESSION_REQS must be >= 1" << std::endl;
+            exit(-1);
+        }
+        // Geometric session lengths with the requested mean. Sessions start
+        // at 1/sessionReqs of TBENCH_QPS, so the request rate stays close to
+        // TBENCH_QPS as long as think times are short
+        continueProb = 1.0 - 1.0 / sessionReqs;
+        lambda /= sessionReqs;
+    } else if (modeStr == "search") {
+        mode = QPS_SEARCH;
+        searchStepNs = getOpt<uint64_t>("TBENCH_SEARCH_STEP_MS", 5000) * 
+            1000 * 1000;
+        searchMaxSteps = getOpt<int>("TBENCH_SEARCH_MAX_STEPS", 20);
+        std::string type = getOpt<std::string>("TBENCH_ARRIVAL_DIST", "exp");
+        if (sloNs == 0 || nprocs != 1 || type == "ramp" || type == "trace") {
+            std::cerr << "TBENCH_LOAD_MODE=search needs TBENCH_SLO_US, a " \
+                << "single client process, and an arrival process driven " \
+                << "by TBENCH_QPS" << std::endl;
+            exit(-1);
+        }
+    } else {
+        std::cerr << "Unknown TBENCH_LOAD_MODE " << modeStr << std::endl;
+        exit(-1);
+    }
+
+    nextTid = 0;
+    threadStates.resize(nthreads, nullptr);
+
+    size_t maxInFlight = getOpt<size_t>("TBENCH_MAXINFLIGHT", 1 << 16);
+    size_t slots = 1;
+    while (slots < maxInFlight) slots <<= 1;
+    inFlightMask = slots - 1;
+    inFlightReqs = new std::atomic<Request*>[slots];
+    for (size_t s = 0; s < slots; ++s) inFlightReqs[s] = nullptr;
+
+    dumpRaw = getOpt<int>("TBENCH_DUMP_RAW_LATS", 0);
+    serverQueues = false;
+    pthread_mutex_init(&statsLock, nullptr);
 
-    tBenchClientInit();
+    issuedReqs = 0;
+    completedReqs = 0;
+    outstandingReqs = 0;
+    roiStartNs = 0;
+    telemetry = nullptr;
+    uint64_t telemetryMs = getOpt<uint64_t>("TBENCH_TELEMETRY_MS", 0);
+    if (telemetryMs) {
+        std::stringstream path;
+        path << "telemetry";
+        if (nprocs > 1) path << "." << rank;
+        path << ".csv";
+
+        telemetry = new Telemetry(path.str(), telemetryMs * 1000 * 1000,
+                ",inflight", [this](std::ostream& out) {
+                    // Read completions first so the difference never wraps
+                    uint64_t completed = completedReqs;
+                    out << "," << issuedReqs - completed;
+                });
+    }
+
+    capture = nullptr;
+    replay = nullptr;
+    replayTiming = false;
+    genStartNs = 0;
+    std::string capturePath = getOpt<std::string>("TBENCH_CAPTURE", "");
+    std::string replayPath = getOpt<std::string>("TBENCH_REPLAY", "");
+    if (!capturePath.empty() && !replayPath.empty()) {
+        std::cerr << "TBENCH_CAPTURE and TBENCH_REPLAY are exclusive" \
+            << std::endl;
+        exit(-1);
+    }
+
+    if (!replayPath.empty()) {
+        // The app's generator never runs, so it is not initialized either
+        replay = new ReqTraceReader(replayPath, rank, nprocs);
+        replayTiming = (mode == OPEN_LOOP) &&
+            getOpt<int>("TBENCH_REPLAY_TIMING", 1);
+        reqClassesUsed = replay->classesUsed();
+        for (int c = 0; c < TBENCH_MAX_REQ_CLASSES; ++c) {
+            reqClassNames[c] = replay->className(c);
+        }
+    } else {
+        if (!capturePath.empty()) {
+            if (nprocs > 1) {
+                std::stringstream path;
+                path << capturePath << "." << rank;
+                capturePath = path.str();
+            }
+            capture = new ReqTraceWriter(capturePath);
+        }
+        tBenchClientInit();
+    }
+
+    if (mode == QPS_SEARCH) {
+        pthread_t thread;
+        int status = pthread_create(&thread, nullptr, searchMain, this);
+        if (status != 0) {
+            std::cerr << "pthread_create() failed: " << strerror(status) \
+                << std::endl;
+            exit(-1);
+        }
+        pthread_detach(thread);
+    }
 }
 
-Request* Client::startReq() {
+Client::ThreadState* Client::getThreadState() {
+    if (clientTid == -1) {
+        clientTid = nextTid++;
+        assert(clientTid < nthreads);
+        threadStates[clientTid] = 
+            new ThreadState(clientTid, threadSeed(seed, clientTid));
+    }
+
+    return threadStates[clientTid];
+}
+
+LatStats* Client::getLatStats() {
+    if (!threadLatStats) {
+        threadLatStats = new LatStats();
+        threadLatStats->window = telemetry ? telemetry->newSlot() : nullptr;
+        pthread_mutex_lock(&statsLock);
+        latStats.push_back(threadLatStats);
+        pthread_mutex_unlock(&statsLock);
+    }
+
+    return threadLatStats;
+}
+
+Request* Client::genReq(bool block) {
+    ThreadState* ts = getThreadState();
+
     if (status == INIT) {
         pthread_barrier_wait(&barrier); // Wait for all threads to start up
 
@@ -67,7 +336,16 @@ Request* Client::startReq() {
 
         if (!dist) {
             uint64_t curNs = getCurNs();
-            dist = new ExpDist(lambda, seed, curNs);
+            dist = createDist(lambda, curNs, rank, nprocs);
+            genStartNs = curNs;
+
+            if (mode == CLOSED_LOOP) {
+                for (int u = 0; u < closedUsers * userConns; ++u) {
+                    readyUsers.push(curNs + drawThinkNs(thinkNs, usersGen));
+                }
+            } else if (mode == PARTLY_OPEN) {
+                nextOpenNs = dist.load()->nextArrivalNs(usersGen);
+            }
 
             status = WARMUP;
 
@@ -80,35 +358,127 @@ Request* Client::startReq() {
         pthread_barrier_wait(&barrier);
     }
 
-    pthread_mutex_lock(&lock);
+    uint64_t arrivalNs;
+    const ReqTraceRecord* rec = nullptr;
+    if (replayTiming) {
+        uint64_t offsetNs;
+        rec = replay->next(&offsetNs);
+        arrivalNs = genStartNs + offsetNs;
+    } else {
+        arrivalNs = nextArrivalNs(ts, block);
+        if (arrivalNs == NO_ARRIVAL) return nullptr;
 
-    Request* req = new Request();
-    size_t len = tBenchClientGenReq(&req->data);
-    req->len = len;
+        uint64_t offsetNs;
+        if (replay) rec = replay->next(&offsetNs);
+    }
 
-    req->id = startedReqs++;
-    req->genNs = dist->nextArrivalNs();
-    inFlightReqs[req->id] = req;
+    Request* req = reinterpret_cast<Request*>(bufPool.alloc(sizeof(Request)));
 
-    pthread_mutex_unlock(&lock);
+    if (rec) {
+        memcpy(req->data, rec->data, rec->len);
+        req->cls = rec->cls;
+        req->len = rec->len;
+    } else {
+        pthread_mutex_lock(&genLock);
+        size_t len = tBenchClientGenReq(&req->data);
+        req->cls = genReqClass;
+        genReqClass = 0;
+        if (capture) {
+            capture->append(arrivalNs - genStartNs, req->cls, req->data, len);
+        }
+        pthread_mutex_unlock(&genLock);
+        req->len = len;
+    }
+
+    req->id = ts->nextSeq++ * nthreads + ts->tid;
+    req->genNs = arrivalNs;
+    req->budgetNs = NO_DEADLINE; // Set when the request is sent
+
+    // Slots only collide once more than inFlightMask requests are outstanding;
+    // wait for the older request to drain rather than overwrite it
+    std::atomic<Request*>& slot = inFlightReqs[req->id & inFlightMask];
+    Request* empty = nullptr;
+    while (!slot.compare_exchange_weak(empty, req)) {
+        empty = nullptr;
+        sched_yield();
+    }
+    ++outstandingReqs;
+
+    return req;
+}
 
+// Arrival time of the next request under the load mode. In CLOSED_LOOP mode,
+// blocks until some user's previous request has completed, or returns
+// NO_ARRIVAL if none has and block is false.
+uint64_t Client::nextArrivalNs(ThreadState* ts, bool block) {
+    if (mode == OPEN_LOOP || mode == QPS_SEARCH) {
+        return dist.load()->nextArrivalNs(ts->gen);
+    }
+
+    uint64_t arrivalNs;
+    pthread_mutex_lock(&usersLock);
+    if (mode == CLOSED_LOOP) {
+        while (block && readyUsers.empty()) {
+            pthread_cond_wait(&usersReady, &usersLock);
+        }
+        if (readyUsers.empty()) {
+            arrivalNs = NO_ARRIVAL;
+        } else {
+            arrivalNs = readyUsers.top();
+            readyUsers.pop();
+        }
+    } else if (!readyUsers.empty() && readyUsers.top() < nextOpenNs) {
+        arrivalNs = readyUsers.top(); // Next request of an ongoing session
+        readyUsers.pop();
+    } else {
+        arrivalNs = nextOpenNs; // First request of a new session
+        nextOpenNs = dist.load()->nextArrivalNs(usersGen);
+    }
+    pthread_mutex_unlock(&usersLock);
+
+    return arrivalNs;
+}
+
+// A closed-loop or partly-open user got its response at curNs; it issues its
+// next request (if its session goes on) after thinking
+void Client::userDone(uint64_t curNs) {
+    pthread_mutex_lock(&usersLock);
+    std::bernoulli_distribution goOn(continueProb);
+    if (mode == CLOSED_LOOP || goOn(usersGen)) {
+        readyUsers.push(curNs + drawThinkNs(thinkNs, usersGen));
+        pthread_cond_signal(&usersReady);
+    }
+    pthread_mutex_unlock(&usersLock);
+}
+
+Request* Client::startReq() {
+    Request* req = genReq();
+    issueReq(req);
+    return req;
+}
+
+void Client::issueReq(Request* req) {
     uint64_t curNs = getCurNs();
 
     if (curNs < req->genNs) {
         sleepUntil(std::max(req->genNs, curNs + minSleepNs));
     }
 
-    return req;
+    if (telemetry) ++issuedReqs;
 }
 
+// Handles both completed and shed requests. Shed requests are only counted;
+// they have no latency to speak of.
 void Client::finiReq(Response* resp) {
-    pthread_mutex_lock(&lock);
+    Request* req = inFlightReqs[resp->id & inFlightMask].exchange(nullptr);
+    assert(req && req->id == resp->id);
+    --outstandingReqs;
 
-    auto it = inFlightReqs.find(resp->id);
-    assert(it != inFlightReqs.end());
-    Request* req = it->second;
+    bool closed = (mode == CLOSED_LOOP || mode == PARTLY_OPEN);
+    bool shed = (resp->type == SHED);
 
-    if (status == ROI) {
+    // Telemetry and closed-loop users also run during the warmup period
+    if (status == ROI || telemetry || closed) {
         uint64_t curNs = getCurNs();
 
         assert(curNs > req->genNs);
@@ -117,54 +487,411 @@ void Client::finiReq(Response* resp) {
         assert(sjrn >= resp->svcNs);
         uint64_t qtime = sjrn - resp->svcNs;
 
-        queueTimes.push_back(qtime);
-        svcTimes.push_back(resp->svcNs);
-        sjrnTimes.push_back(sjrn);
+        LatStats* stats = getLatStats();
+        if (telemetry) {
+            if (!shed) Telemetry::record(stats->window, sjrn);
+            ++completedReqs;
+        }
+
+        if (status == ROI) {
+            bool searching = (mode == QPS_SEARCH);
+            if (searching) pthread_mutex_lock(&stats->lock);
+
+            LatStats* cs = reqClassesUsed ? stats->forClass(req->cls) : nullptr;
+            if (shed) {
+                ++stats->shedReqs;
+                if (cs) ++cs->shedReqs;
+            } else {
+                bool metSlo = sloNs && (sjrn <= sloNs);
+                for (LatStats* s : { stats, cs }) {
+                    if (!s) continue;
+                    s->queueTimes.record(qtime);
+                    s->svcTimes.record(resp->svcNs);
+                    s->sjrnTimes.record(sjrn);
+                    if (serverQueues) s->waitTimes.record(resp->waitNs);
+                    if (metSlo) ++s->metSloReqs;
+                }
+
+                if (dumpRaw) {
+                    stats->raw.push_back(qtime);
+                    stats->raw.push_back(resp->svcNs);
+                    stats->raw.push_back(sjrn);
+                    stats->rawClasses.push_back(req->cls);
+                    stats->rawTimes.push_back(curNs > roiStartNs ?
+                            curNs - roiStartNs : 0);
+                }
+            }
+
+            if (searching) pthread_mutex_unlock(&stats->lock);
+        }
+
+        if (closed) userDone(curNs);
     }
 
-    delete req;
-    inFlightReqs.erase(it);
-    pthread_mutex_unlock(&lock);
+    bufPool.release(reinterpret_cast<char*>(req));
 }
 
 void Client::_startRoi() {
     assert(status == WARMUP);
-    status = ROI;
-
-    queueTimes.clear();
-    svcTimes.clear();
-    sjrnTimes.clear();
+    // Set first, so requests recorded in the ROI complete after it
+    roiStartNs = getCurNs();
+    status = ROI; // Nothing is recorded before this, so no stats to clear
 }
 
 void Client::startRoi() {
     pthread_mutex_lock(&lock);
-    _startRoi();
+    // With several connections, the server announces the ROI on each of them
+    if (status == WARMUP) _startRoi();
     pthread_mutex_unlock(&lock);
 }
 
+// Writes one table of percentiles, headed by title and by the number of shed
+// requests and the goodput under sloNs, if any. qps is the throughput of
+// completed requests.
+static void writeTable(std::ostream& pct, const std::string& title,
+        const LatStats& stats, double qps, uint64_t sloNs) {
+    const double pcts[] = { 50.0, 90.0, 95.0, 99.0, 99.9, 99.99 };
+    const char* allNames[] = { "QueueTimes", "ServiceTimes", "SojournTimes",
+        "SchedLags", "ServerWaits" };
+    const Histogram* allHists[] = { &stats.queueTimes, &stats.svcTimes, 
+        &stats.sjrnTimes, &stats.schedLags, &stats.waitTimes };
+
+    // Schedule lags and server queue waits only exist where requests go over
+    // the network or shared memory
+    const char* names[5];
+    const Histogram* hists[5];
+    int ncols = 0;
+    for (int c = 0; c < 5; ++c) {
+        if (c >= 3 && !allHists[c]->count()) continue;
+        names[ncols] = allNames[c];
+        hists[ncols] = allHists[c];
+        ++ncols;
+    }
+
+    pct << "# " << title << std::endl;
+
+    uint64_t completed = stats.sjrnTimes.count();
+    if (stats.shedReqs) {
+        pct << "# " << stats.shedReqs << " requests shed (" << std::fixed \
+            << std::setprecision(1) \
+            << 100.0 * stats.shedReqs / (completed + stats.shedReqs) \
+            << "% of those answered)" << std::endl;
+    }
+    if (sloNs) {
+        double goodput = completed ? qps * stats.metSloReqs / completed : 0.0;
+        pct << "# " << stats.metSloReqs << " requests within the " \
+            << std::fixed << std::setprecision(1) << sloNs / 1e3 \
+            << " us SLO (goodput " << goodput << " QPS)" << std::endl;
+    }
+
+    pct << std::setw(8) << "";
+    for (int c = 0; c < ncols; ++c) pct << std::setw(14) << names[c];
+    pct << std::endl;
+
+    pct << std::setw(8) << "mean" << std::fixed << std::setprecision(0);
+    for (int c = 0; c < ncols; ++c) pct << std::setw(14) << hists[c]->mean();
+    pct << std::endl;
+
+    for (double p : pcts) {
+        std::stringstream label;
+        label << "p" << p;
+        pct << std::setw(8) << label.str();
+        for (int c = 0; c < ncols; ++c) {
+            pct << std::setw(14) << hists[c]->percentile(p);
+        }
+        pct << std::endl;
+    }
+
+    pct << std::setw(8) << "max";
+    for (int c = 0; c < ncols; ++c) pct << std::setw(14) << hists[c]->max();
+    pct << std::endl;
+}
+
+static void printSummary(const std::string& label, const Histogram& sjrnTimes) {
+    std::cout << label << ": " << sjrnTimes.count() << " requests | 95th " \
+        << "percentile latency " << sjrnTimes.percentile(95.0) / 1e6 \
+        << " ms | 99th percentile latency " \
+        << sjrnTimes.percentile(99.0) / 1e6 << " ms | max latency " \
+        << sjrnTimes.max() / 1e6 << " ms" << std::endl;
+}
+
+// qps is the throughput the stats were measured at. If the app tags requests
+// with classes, the overall table is followed by one for each class.
+static void writePercentiles(const std::string& path, const LatStats& stats,
+        double qps, uint64_t sloNs) {
+    const Histogram& sjrnTimes = stats.sjrnTimes;
+
+    std::ofstream pct(path.c_str());
+    std::stringstream title;
+    title << "Latencies in ns over " << sjrnTimes.count() << " requests (" \
+        << std::fixed << std::setprecision(1) << qps << " QPS)";
+    writeTable(pct, title.str(), stats, qps, sloNs);
+    printSummary(path, sjrnTimes);
+
+    for (size_t c = 0; c < stats.classes.size(); ++c) {
+        const LatStats* cs = stats.classes[c];
+        if (!cs || !(cs->sjrnTimes.count() + cs->shedReqs)) continue;
+
+        std::stringstream name;
+        name << "class " << c;
+        if (!reqClassNames[c].empty()) name << " (" << reqClassNames[c] << ")";
+
+        uint64_t count = cs->sjrnTimes.count();
+        double classQps = count ? qps * count / sjrnTimes.count() : 0.0;
+        std::stringstream classTitle;
+        classTitle << "Latencies in ns of " << name.str() << " over " \
+            << count << " requests (" << std::fixed \
+            << std::setprecision(1) << classQps << " QPS)";
+        pct << std::endl;
+        writeTable(pct, classTitle.str(), *cs, classQps, sloNs);
+        printSummary(path + " " + name.str(), cs->sjrnTimes);
+    }
+
+    pct.close();
+}
+
+static std::string rankStatsPath(const std::string& dir, int rank) {
+    std::stringstream ss;
+    ss << dir << "/lats." << rank << ".hist";
+    return ss.str();
+}
+
+// Rank 0 waits for every other rank's histograms to show up in statsDir, then
+// writes the combined percentiles to statsDir/lats.pct
+void Client::mergeRanks(const LatStats& local, double localQps) {
+    const int TIMEOUT_S = 60;
+
+    LatStats* merged = new LatStats();
+    merged->merge(local);
+    double totalQps = localQps;
+
+    LatStats* other = new LatStats();
+    int found = 1;
+    for (int r = 1; r < nprocs; ++r) {
+        std::string path = rankStatsPath(statsDir, r);
+        std::ifstream in;
+        for (int t = 0; t < TIMEOUT_S * 10; ++t) {
+            in.open(path.c_str(), std::ios::in | std::ios::binary);
+            if (in.is_open()) break;
+            usleep(100 * 1000);
+        }
+
+        double qps;
+        if (!in.is_open() || !other->read(in) ||
+                !in.read(reinterpret_cast<char*>(&qps), sizeof(qps))) {
+            std::cerr << "WARNING: No stats from client rank " << r \
+                << " in " << path << ", leaving it out" << std::endl;
+            continue;
+        }
+
+        merged->merge(*other);
+        totalQps += qps;
+        ++found;
+    }
+
+    std::cout << "Merged stats from " << found << " of " << nprocs \
+        << " client processes" << std::endl;
+    writePercentiles(statsDir + "/lats.pct", *merged, totalQps, sloNs);
+
+    delete merged;
+    delete other;
+}
+
 void Client::dumpStats() {
-    std::ofstream out("lats.bin", std::ios::out | std::ios::binary);
-    int reqs = sjrnTimes.size();
+    if (capture) {
+        pthread_mutex_lock(&genLock);
+        capture->flush(reqClassesUsed, reqClassNames);
+        pthread_mutex_unlock(&genLock);
+    }
+
+    LatStats* local = new LatStats();
 
-    for (int r = 0; r < reqs; ++r) {
-        out.write(reinterpret_cast<const char*>(&queueTimes[r]), 
-                    sizeof(queueTimes[r]));
-        out.write(reinterpret_cast<const char*>(&svcTimes[r]), 
-                    sizeof(svcTimes[r]));
-        out.write(reinterpret_cast<const char*>(&sjrnTimes[r]), 
-                    sizeof(sjrnTimes[r]));
+    pthread_mutex_lock(&statsLock);
+    for (LatStats* stats : latStats) local->merge(*stats);
+    pthread_mutex_unlock(&statsLock);
+
+    uint64_t roiNs = getCurNs() - roiStartNs;
+    double qps = roiStartNs ? local->sjrnTimes.count() * 1e9 / roiNs : 0.0;
+
+    if (nprocs == 1) {
+        writePercentiles("lats.pct", *local, qps, sloNs);
+    } else {
+        std::stringstream pctPath;
+        pctPath << "lats." << rank << ".pct";
+        writePercentiles(pctPath.str(), *local, qps, sloNs);
+
+        // Write to a temp file and rename, so rank 0 never sees a partial file
+        std::string path = rankStatsPath(statsDir, rank);
+        std::string tmpPath = path + ".tmp";
+        std::ofstream out(tmpPath.c_str(), std::ios::out | std::ios::binary);
+        local->write(out);
+        out.write(reinterpret_cast<const char*>(&qps), sizeof(qps));
+        out.close();
+        if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+            std::cerr << "rename() failed: " << strerror(errno) << std::endl;
+        }
+
+        if (rank == 0) mergeRanks(*local, qps);
+    }
+
+    delete local;
+
+    if (!dumpRaw) return;
+
+    std::ofstream out("lats.bin", std::ios::out | std::ios::binary);
+    for (LatStats* stats : latStats) {
+        out.write(reinterpret_cast<const char*>(stats->raw.data()), 
+                stats->raw.size() * sizeof(uint64_t));
     }
     out.close();
+
+    // Completion times and classes go in separate files, one entry per
+    // request in lats.bin order, so readers of lats.bin are unaffected
+    std::ofstream timesOut("lats.times.bin", std::ios::out | std::ios::binary);
+    for (LatStats* stats : latStats) {
+        timesOut.write(reinterpret_cast<const char*>(stats->rawTimes.data()),
+                stats->rawTimes.size() * sizeof(uint64_t));
+    }
+    timesOut.close();
+
+    if (!reqClassesUsed) return;
+    std::ofstream clsOut("lats.classes.bin", std::ios::out | std::ios::binary);
+    for (LatStats* stats : latStats) {
+        clsOut.write(reinterpret_cast<const char*>(stats->rawClasses.data()),
+                stats->rawClasses.size());
+    }
+    clsOut.close();
+}
+
+void* Client::searchMain(void* ptr) {
+    reinterpret_cast<Client*>(ptr)->searchMaxQps();
+    return nullptr;
+}
+
+// Collects and clears the stats of all threads
+LatStats* Client::drainStats() {
+    LatStats* drained = new LatStats();
+
+    pthread_mutex_lock(&statsLock);
+    for (LatStats* stats : latStats) {
+        pthread_mutex_lock(&stats->lock);
+        drained->merge(*stats);
+        stats->reset();
+        pthread_mutex_unlock(&stats->lock);
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    return drained;
+}
+
+// Runs the ROI as a series of fixed-rate steps, starting at TBENCH_QPS and
+// doubling the rate until a step misses the SLO, then bisecting between the
+// best passing and worst failing rates. Each step's latencies are written to
+// lats.step<k>.pct and summarized in search.csv. Exits the process when done.
+void Client::searchMaxQps() {
+    const double TOLERANCE = 0.02; // Of the failing rate
+
+    while (status != ROI) usleep(10 * 1000);
+
+    std::ofstream csv("search.csv");
+    csv << "step,offered_qps,achieved_qps,p50_ns,p99_ns,slo_met" << std::endl;
+
+    double qps = lambda * 1e9;
+    double good = 0.0;
+    double bad = 0.0;
+    double prevQps = qps; // Rate of the previous step (or of warmup)
+    uint64_t drainTo = 0; // Requests outstanding once a backlog has drained
+
+    for (int step = 0; step < searchMaxSteps; ++step) {
+        // Outstanding requests as the previous rate left them
+        uint64_t startReqs = outstandingReqs;
+        double stepQps = qps;
+
+        // Dists are leaked, since generator threads may still be using the
+        // previous one; there are only a handful of steps
+        dist = createDist(qps * 1e-9, getCurNs(), rank, nprocs);
+
+        // A step that missed leaves a backlog, which would otherwise drain
+        // while the next, slower step is measured and count against it. Wait
+        // (for up to a step) until as many requests are outstanding as
+        // before the missed step, scaled to the new rate by Little's law.
+        if (drainTo) {
+            uint64_t giveUpNs = getCurNs() + searchStepNs;
+            while (outstandingReqs > drainTo && getCurNs() < giveUpNs) {
+                usleep(1000);
+            }
+            drainTo = 0;
+        }
+
+        // Leave the first fifth of the step for queues to settle at the new
+        // rate, and measure the rest
+        sleepUntil(getCurNs() + searchStepNs / 5);
+        delete drainStats();
+        uint64_t startNs = getCurNs();
+        sleepUntil(startNs + searchStepNs - searchStepNs / 5);
+        LatStats* stats = drainStats();
+        uint64_t endNs = getCurNs();
+
+        double achieved = stats->sjrnTimes.count() * 1e9 / (endNs - startNs);
+        uint64_t p99 = stats->sjrnTimes.percentile(99.0);
+
+        // A growing backlog is a miss even if the requests that made it
+        // through were fast
+        bool met = (p99 <= sloNs) && (achieved >= 0.9 * qps);
+
+        std::stringstream path;
+        path << "lats.step" << step << ".pct";
+        writePercentiles(path.str(), *stats, achieved, sloNs);
+        csv << step << "," << std::fixed << std::setprecision(1) << qps \
+            << "," << achieved << "," << stats->sjrnTimes.percentile(50.0) \
+            << "," << p99 << "," << met << std::endl;
+        delete stats;
+
+        if (met) {
+            good = qps;
+        } else {
+            bad = qps;
+        }
+
+        if (bad == 0.0) {
+            qps *= 2;
+        } else if (bad - good <= TOLERANCE * bad) {
+            break;
+        } else {
+            qps = (good + bad) / 2;
+        }
+
+        if (!met) drainTo = std::max<uint64_t>(1, startReqs * qps / prevQps);
+        prevQps = stepQps;
+    }
+
+    csv.close();
+    std::cout << "Max QPS with p99 under " << sloNs / 1e3 << " us: " << good \
+        << std::endl;
+    syscall(SYS_exit_group, 0);
 }
 
 /*******************************************************************************
  * Networked Client
  *******************************************************************************/
+NetworkedClient::NetworkedClient(int nthreads, int nconns) : Client(nthreads) {
+    lookaheadNs = getOpt<uint64_t>("TBENCH_CLIENT_LOOKAHEAD_US", 10000) * 1000;
+    uint64_t defSpinUs = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? 250 : 0;
+    spinNs = getOpt<uint64_t>("TBENCH_CLIENT_SPIN_US", defSpinUs) * 1000;
+    userConns = nconns; // Closed-loop users are per connection
+    serverQueues = true;
+
+    conns.resize(nconns);
+    for (Conn& conn : conns) {
+        conn.fd = -1;
+        conn.pending = new MpmcQueue<Request*>(inFlightMask + 1);
+        sem_init(&conn.pendingReqs, 0, 0);
+    }
+}
+
 NetworkedClient::NetworkedClient(int nthreads, std::string serverip, 
-        int serverport) : Client(nthreads)
+        int serverport, int nconns) : NetworkedClient(nthreads, nconns)
 {
-    pthread_mutex_init(&sendLock, nullptr);
-    pthread_mutex_init(&recvLock, nullptr);
 
     // Get address info
     int status;
@@ -188,53 +915,135 @@ NetworkedClient::NetworkedClient(int nthreads, std::string serverip,
         exit(-1);
     }
 
-    serverFd = socket(servInfo->ai_family, servInfo->ai_socktype, \
-            servInfo->ai_protocol);
-    if (serverFd == -1) {
-        std::cerr << "socket() failed: " << strerror(errno) << std::endl;
-        exit(-1);
+    for (Conn& conn : conns) {
+        conn.fd = socket(servInfo->ai_family, servInfo->ai_socktype, \
+                servInfo->ai_protocol);
+        if (conn.fd == -1) {
+            std::cerr << "socket() failed: " << strerror(errno) << std::endl;
+            exit(-1);
+        }
+
+        if (connect(conn.fd, servInfo->ai_addr, servInfo->ai_addrlen) == -1) {
+            std::cerr << "connect() failed: " << strerror(errno) << std::endl;
+            exit(-1);
+        }
+
+        int nodelay = 1;
+        if (setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, 
+                    reinterpret_cast<char*>(&nodelay), sizeof(nodelay)) == -1) {
+            std::cerr << "setsockopt(TCP_NODELAY) failed: " \
+                << strerror(errno) << std::endl;
+            exit(-1);
+        }
     }
+}
 
-    if (connect(serverFd, servInfo->ai_addr, servInfo->ai_addrlen) == -1) {
-        std::cerr << "connect() failed: " << strerror(errno) << std::endl;
-        exit(-1);
+// Called by generator threads. Holds on to req until it is due within the
+// lookahead window, which bounds how far ahead generation runs, then passes it
+// to its connection's dispatcher.
+void NetworkedClient::schedule(Request* req) {
+    uint64_t curNs = getCurNs();
+    if (req->genNs > curNs + lookaheadNs) {
+        sleepUntil(req->genNs - lookaheadNs);
     }
 
-    int nodelay = 1;
-    if (setsockopt(serverFd, IPPROTO_TCP, TCP_NODELAY, 
-                reinterpret_cast<char*>(&nodelay), sizeof(nodelay)) == -1) {
-        std::cerr << "setsockopt(TCP_NODELAY) failed: " << strerror(errno) \
-            << std::endl;
-        exit(-1);
+    Conn& conn = conns[req->id % conns.size()];
+    while (!conn.pending->push(req)) sched_yield();
+    sem_post(&conn.pendingReqs);
+}
+
+// Dispatcher loop for one connection: sends requests in order of their
+// scheduled times, as close to those times as possible. Returns false if
+// sending fails.
+bool NetworkedClient::dispatch(int c) {
+    Conn& conn = conns[c];
+
+    auto later = [](const Request* a, const Request* b) {
+        return a->genNs > b->genNs;
+    };
+    std::priority_queue<Request*, std::vector<Request*>, decltype(later)> 
+        due(later);
+
+    while (true) {
+        Request* req;
+
+        // Block only when there is nothing to send; otherwise just pick up
+        // whatever the generators have produced since the last send
+        if (due.empty()) {
+            while (sem_wait(&conn.pendingReqs) == -1 && errno == EINTR);
+            while (!conn.pending->pop(&req)) sched_yield();
+            due.push(req);
+        }
+        while (sem_trywait(&conn.pendingReqs) == 0) {
+            while (!conn.pending->pop(&req)) sched_yield();
+            due.push(req);
+        }
+
+        // Sleep until spinNs before the send is due, then poll the clock,
+        // since waking from a sleep takes tens of us and the lag would
+        // count toward the request's latency
+        req = due.top();
+        uint64_t curNs = getCurNs();
+        if (curNs < req->genNs) {
+            if (req->genNs - curNs > spinNs) {
+                sleepUntil(std::max(req->genNs - spinNs, curNs + minSleepNs));
+            } else {
+                while (getCurNs() < req->genNs) {
+#if defined(__x86_64__) || defined(__i386__)
+                    asm volatile("pause");
+#endif
+                }
+            }
+            continue; // Something more urgent may have arrived meanwhile
+        }
+
+        due.pop();
+
+        // The deadline travels as the time left to it, which the server
+        // counts from when it gets the request
+        if (sloNs) {
+            uint64_t deadlineNs = req->genNs + sloNs;
+            req->budgetNs = (curNs < deadlineNs) ? deadlineNs - curNs : 0;
+        }
+
+        if (status == ROI) {
+            LatStats* stats = getLatStats();
+            bool searching = (mode == QPS_SEARCH);
+            if (searching) pthread_mutex_lock(&stats->lock);
+            stats->schedLags.record(curNs - req->genNs);
+            if (searching) pthread_mutex_unlock(&stats->lock);
+        }
+
+        if (!send(c, req)) return false;
     }
 }
 
-bool NetworkedClient::send(Request* req) {
-    pthread_mutex_lock(&sendLock);
+// Each connection has a single dispatcher thread, so no locking is needed
+bool NetworkedClient::send(int c, Request* req) {
+    if (telemetry) ++issuedReqs; // Before the response can possibly arrive
 
-    int len = sizeof(Request) - MAX_REQ_BYTES + req->len;
-    int sent = sendfull(serverFd, reinterpret_cast<const char*>(req), len, 0);
+    int len = REQ_HDR_BYTES + req->len;
+    int sent = sendfull(conns[c].fd, reinterpret_cast<const char*>(req), len, 0);
     if (sent != len) {
         error = strerror(errno);
     }
 
-    pthread_mutex_unlock(&sendLock);
-
     return (sent == len);
 }
 
-bool NetworkedClient::recv(Response* resp) {
-    pthread_mutex_lock(&recvLock);
+// Each connection has a single receiver thread, so no locking is needed
+bool NetworkedClient::recv(int c, Response* resp) {
+    int fd = conns[c].fd;
 
-    int len = sizeof(Response) - MAX_RESP_BYTES; // Read request header first
-    int recvd = recvfull(serverFd, reinterpret_cast<char*>(resp), len, 0);
+    int len = RESP_HDR_BYTES; // Read response header first
+    int recvd = recvfull(fd, reinterpret_cast<char*>(resp), len, 0);
     if (recvd != len) {
         error = strerror(errno);
         return false;
     }
 
     if (resp->type == RESPONSE) {
-        recvd = recvfull(serverFd, reinterpret_cast<char*>(&resp->data), \
+        recvd = recvfull(fd, reinterpret_cast<char*>(&resp->data), \
                 resp->len, 0);
 
         if (static_cast<size_t>(recvd) != resp->len) {
@@ -243,8 +1052,203 @@ bool NetworkedClient::recv(Response* resp) {
         }
     }
 
-    pthread_mutex_unlock(&recvLock);
+    return true;
+}
+
+/*******************************************************************************
+ * Shared-memory Client
+ *******************************************************************************/
+ShmClient::ShmClient(int nthreads, std::string name, int nconns)
+    : NetworkedClient(nthreads, nconns)
+{
+    const int ATTACH_TIMEOUT_S = 10;
+
+    spinNs = shmSpinNs();
+
+    shm = shmAttach(name, ATTACH_TIMEOUT_S);
+
+    uint32_t first = shm->claimed.fetch_add(nconns);
+    if (first + nconns > shm->nchannels) {
+        std::cerr << "Server at " << name << " only takes " \
+            << shm->nchannels << " connections" << std::endl;
+        exit(-1);
+    }
+
+    for (int c = 0; c < nconns; ++c) {
+        ShmChannel* chan = shm->channel(first + c);
+        chan->clientPid = getpid();
+        channels.push_back(chan);
+    }
+}
+
+bool ShmClient::serverAlive() {
+    if (kill(shm->serverPid, 0) == 0 || errno != ESRCH) return true;
+    error = "server exited";
+    return false;
+}
+
+// Each connection has a single dispatcher thread, so it is the only producer
+// on its request ring
+bool ShmClient::send(int c, Request* req) {
+    if (telemetry) ++issuedReqs; // Before the response can possibly arrive
+
+    ShmRing& ring = channels[c]->reqs;
+    struct iovec iov = { req, REQ_HDR_BYTES + req->len };
+    uint64_t checkNs = getCurNs() + SERVER_CHECK_NS;
+    while (ring.space() < iov.iov_len) {
+        sched_yield(); // Server is backed up
+        if (getCurNs() < checkNs) continue;
+        if (!serverAlive()) return false;
+        checkNs = getCurNs() + SERVER_CHECK_NS;
+    }
+
+    ring.write(reinterpret_cast<char*>(shm), &iov, 1);
+    shm->reqBell.ring();
 
     return true;
 }
 
+// Each connection has a single receiver thread, so it is the only consumer of
+// its response ring
+bool ShmClient::recv(int c, Response* resp) {
+    ShmChannel* chan = channels[c];
+    ShmRing& ring = chan->resps;
+    char* base = reinterpret_cast<char*>(shm);
+
+    while (!chan->respBell.wait([&ring]() { return !ring.empty(); }, spinNs,
+                SERVER_CHECK_NS)) {
+        if (!serverAlive()) return false;
+    }
+
+    ring.peek(base, 0, reinterpret_cast<char*>(resp), RESP_HDR_BYTES);
+    if (resp->type == RESPONSE) {
+        ring.peek(base, RESP_HDR_BYTES, reinterpret_cast<char*>(&resp->data),
+                resp->len);
+    }
+    ring.consume(RESP_HDR_BYTES + (resp->type == RESPONSE ? resp->len : 0));
+
+    return true;
+}
+
+/*******************************************************************************
+ * Networked client driver
+ *******************************************************************************/
+struct ConnThread {
+    NetworkedClient* client;
+    int conn;
+};
+
+static std::atomic_flag finished = ATOMIC_FLAG_INIT;
+
+static void* generateMain(void* c) {
+    NetworkedClient* client = reinterpret_cast<NetworkedClient*>(c);
+
+    while (true) {
+        Request* req = client->genReq();
+        client->schedule(req);
+    }
+
+    return nullptr;
+}
+
+static void* sendMain(void* d) {
+    ConnThread* dispatcher = reinterpret_cast<ConnThread*>(d);
+    NetworkedClient* client = dispatcher->client;
+
+    if (!client->dispatch(dispatcher->conn)) {
+        std::cerr << "[CLIENT] send() failed : " << client->errmsg() \
+            << std::endl;
+        std::cerr << "[CLIENT] Not sending further request" << std::endl;
+    }
+
+    return nullptr;
+}
+
+static void* recvMain(void* r) {
+    ConnThread* receiver = reinterpret_cast<ConnThread*>(r);
+    NetworkedClient* client = receiver->client;
+
+    Response* resp = new Response();
+    while (true) {
+        if (!client->recv(receiver->conn, resp)) {
+            std::cerr << "[CLIENT] recv() failed : " << client->errmsg() \
+                << std::endl;
+
+            // Without responses, generators soon run out of in-flight slots
+            // and senders out of requests, so nothing else would end the run
+            syscall(SYS_exit_group, -1);
+        }
+
+        if (resp->type == RESPONSE || resp->type == SHED) {
+            client->finiReq(resp);
+        } else if (resp->type == ROI_BEGIN) {
+            client->startRoi();
+        } else if (resp->type == FINISH) {
+            // Every connection gets a FINISH; only the first one dumps stats
+            if (!finished.test_and_set()) {
+                client->dumpStats();
+                syscall(SYS_exit_group, 0);
+            }
+            return nullptr;
+        } else {
+            std::cerr << "Unknown response type: " << resp->type << std::endl;
+            return nullptr;
+        }
+    }
+}
+
+int runNetworkedClient(NetworkedClient* (*makeClient)(int nthreads,
+            int nconns)) {
+    int nthreads = getOpt<int>("TBENCH_CLIENT_THREADS", 1);
+    int nconns = getOpt<int>("TBENCH_CLIENT_CONNS", 1);
+    NetworkedClient* client = makeClient(nthreads, nconns);
+
+    std::vector<pthread_t> generators(nthreads);
+    std::vector<pthread_t> senders(nconns);
+    std::vector<pthread_t> receivers(nconns);
+    std::vector<ConnThread> connThreads(nconns);
+
+    for (int t = 0; t < nthreads; ++t) {
+        int status = pthread_create(&generators[t], nullptr, generateMain, 
+                reinterpret_cast<void*>(client));
+        assert(status == 0);
+    }
+
+    for (int c = 0; c < nconns; ++c) {
+        connThreads[c].client = client;
+        connThreads[c].conn = c;
+
+        int status = pthread_create(&senders[c], nullptr, sendMain, 
+                reinterpret_cast<void*>(&connThreads[c]));
+        assert(status == 0);
+
+        status = pthread_create(&receivers[c], nullptr, recvMain, 
+                reinterpret_cast<void*>(&connThreads[c]));
+        assert(status == 0);
+    }
+
+    for (int c = 0; c < nconns; ++c) {
+        int status = pthread_join(senders[c], nullptr);
+        assert(status == 0);
+
+        status = pthread_join(receivers[c], nullptr);
+        assert(status == 0);
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * API
+ *******************************************************************************/
+void tBenchClientSetReqClass(unsigned cls, const char* name) {
+    if (cls >= TBENCH_MAX_REQ_CLASSES) {
+        std::cerr << "ERROR! Request class " << cls << " exceeds " \
+            << "TBENCH_MAX_REQ_CLASSES" << std::endl;
+        exit(-1);
+    }
+
+    genReqClass = cls;
+    reqClassesUsed = true;
+    if (name && reqClassNames[cls].empty()) reqClassNames[cls] = name;
+}
@@ -17,45 +17,271 @@
 #ifndef __CLIENT_H
 #define __CLIENT_H
 
-#include "msgs.h"
+#include "bufpool.h"
 #include "msgs.h"
 #include "dist.h"
+#include "hist.h"
+#include "mpmc.h"
+#include "reqtrace.h"
+#include "shm.h"
+#include "tbench_client.h"
+#include "telemetry.h"
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <queue>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
 enum ClientStatus { INIT, WARMUP, ROI, FINISHED };
 
+// How request arrival times are decided. OPEN_LOOP draws them from the arrival
+// process regardless of completions. CLOSED_LOOP keeps a fixed population of
+// users, each issuing its next request a think time after its previous one
+// completes. PARTLY_OPEN starts user sessions from the arrival process, each
+// issuing a random number of requests closed-loop. QPS_SEARCH runs open-loop
+// in steps, adjusting the rate to find the highest load that meets a p99 SLO.
+enum LoadMode { OPEN_LOOP, CLOSED_LOOP, PARTLY_OPEN, QPS_SEARCH };
+
+// Latency stats recorded by one thread that calls Client::finiReq(). Threads
+// only ever touch their own, and Client::dumpStats() merges them at the end.
+// In QPS_SEARCH mode, lock is held while recording, so the search can drain
+// the stats after every step.
+struct LatStats {
+    pthread_mutex_t lock;
+    Histogram queueTimes;
+    Histogram svcTimes;
+    Histogram sjrnTimes;
+    Histogram schedLags; // Networked only: dispatch time - intended time
+    Histogram waitTimes; // Networked only: time in the server's queue
+    uint64_t shedReqs;   // Dropped by the server, not in the histograms
+    uint64_t metSloReqs; // Completed within TBENCH_SLO_US, if set
+    std::vector<uint64_t> raw; // (queue, svc, sjrn) triples, if dumpRaw
+    std::vector<uint8_t> rawClasses; // Request class of each triple
+    std::vector<uint64_t> rawTimes; // When each completed, from ROI start
+    Telemetry::Slot* window; // Sojourn times in the live window, if enabled
+
+    // Stats of each request class, if the app tags requests; allocated on
+    // first use
+    std::vector<LatStats*> classes;
+
+    LatStats() : shedReqs(0), metSloReqs(0), window(nullptr) {
+        pthread_mutex_init(&lock, nullptr);
+    }
+
+    ~LatStats() {
+        for (LatStats* cs : classes) delete cs;
+    }
+
+    LatStats* forClass(unsigned cls) {
+        if (classes.size() <= cls) classes.resize(cls + 1, nullptr);
+        if (!classes[cls]) classes[cls] = new LatStats();
+        return classes[cls];
+    }
+
+    void merge(const LatStats& other) {
+        queueTimes.merge(other.queueTimes);
+        svcTimes.merge(other.svcTimes);
+        sjrnTimes.merge(other.sjrnTimes);
+        schedLags.merge(other.schedLags);
+        waitTimes.merge(other.waitTimes);
+        shedReqs += other.shedReqs;
+        metSloReqs += other.metSloReqs;
+        for (size_t c = 0; c < other.classes.size(); ++c) {
+            if (other.classes[c]) forClass(c)->merge(*other.classes[c]);
+        }
+    }
+
+    void reset() {
+        queueTimes.reset();
+        svcTimes.reset();
+        sjrnTimes.reset();
+        schedLags.reset();
+        waitTimes.reset();
+        shedReqs = 0;
+        metSloReqs = 0;
+        raw.clear();
+        rawClasses.clear();
+        rawTimes.clear();
+        for (LatStats* cs : classes) {
+            if (cs) cs->reset();
+        }
+    }
+
+    // Serialized as the histograms and counters, then the number of class
+    // slots and, for each, whether it is in use and its stats
+    void write(std::ostream& out) const {
+        queueTimes.write(out);
+        svcTimes.write(out);
+        sjrnTimes.write(out);
+        schedLags.write(out);
+        waitTimes.write(out);
+
+        uint64_t counts[2] = { shedReqs, metSloReqs };
+        out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+
+        uint64_t nclasses = classes.size();
+        out.write(reinterpret_cast<const char*>(&nclasses), sizeof(nclasses));
+        for (LatStats* cs : classes) {
+            uint8_t used = (cs != nullptr);
+            out.write(reinterpret_cast<const char*>(&used), sizeof(used));
+            if (cs) cs->write(out);
+        }
+    }
+
+    bool read(std::istream& in) {
+        reset();
+        if (!queueTimes.read(in) || !svcTimes.read(in) ||
+                !sjrnTimes.read(in) || !schedLags.read(in) ||
+                !waitTimes.read(in)) {
+            return false;
+        }
+
+        uint64_t counts[2];
+        if (!in.read(reinterpret_cast<char*>(counts), sizeof(counts))) {
+            return false;
+        }
+        shedReqs = counts[0];
+        metSloReqs = counts[1];
+
+        uint64_t nclasses;
+        if (!in.read(reinterpret_cast<char*>(&nclasses), sizeof(nclasses)) ||
+                nclasses > TBENCH_MAX_REQ_CLASSES) {
+            return false;
+        }
+        for (uint64_t c = 0; c < nclasses; ++c) {
+            uint8_t used;
+            if (!in.read(reinterpret_cast<char*>(&used), sizeof(used))) {
+                return false;
+            }
+            if (used && !forClass(c)->read(in)) return false;
+        }
+        return true;
+    }
+};
+
 class Client {
     protected:
+        // State private to each thread that calls startReq(). Threads own
+        // disjoint request ID ranges (id % nthreads == tid) and draw arrivals
+        // from their own random sub-stream, so generating a request never
+        // contends with other threads beyond one atomic on the arrival clock
+        struct ThreadState {
+            int tid;
+            uint64_t nextSeq;
+            DistGen gen;
+            char pad[64]; // Keep neighboring threads' state off our line
+
+            ThreadState(int tid, uint64_t seed) 
+                : tid(tid), nextSeq(0), gen(seed) {}
+        };
+
         ClientStatus status;
 
         int nthreads;
         pthread_mutex_t lock;
+        pthread_mutex_t genLock; // Serializes tBenchClientGenReq() only
         pthread_barrier_t barrier;
 
         uint64_t minSleepNs;
         uint64_t seed;
         double lambda;
-        ExpDist* dist;
+        std::atomic<Dist*> dist; // Replaced at every QPS_SEARCH step
+
+        // Closed-loop and partly-open users waiting to issue their next
+        // request, as a min-heap of the times they are due
+        LoadMode mode;
+        pthread_mutex_t usersLock;
+        pthread_cond_t usersReady;
+        std::priority_queue<uint64_t, std::vector<uint64_t>,
+            std::greater<uint64_t>> readyUsers;
+        DistGen usersGen; // Think times and session lengths; under usersLock
+        double thinkNs;   // Mean think time
+        double continueProb; // PARTLY_OPEN: chance a session issues another
+        uint64_t nextOpenNs; // PARTLY_OPEN: next session arrival
+        int closedUsers;  // CLOSED_LOOP: users per connection
+        int userConns;    // Connections the users are spread over
+
+        // Returned by nextArrivalNs() when no arrival is possible yet
+        static const uint64_t NO_ARRIVAL = UINT64_MAX;
+
+        uint64_t nextArrivalNs(ThreadState* ts, bool block);
+        void userDone(uint64_t curNs);
+
+        // Requests carry a deadline this long after their arrival, and count
+        // toward goodput if they complete by it. QPS_SEARCH also holds each
+        // step's p99 to it. 0 = none
+        uint64_t sloNs;
+
+        // QPS_SEARCH parameters
+        uint64_t searchStepNs;
+        int searchMaxSteps;
 
-        uint64_t startedReqs;
-        std::unordered_map<uint64_t, Request*> inFlightReqs;
+        static void* searchMain(void* ptr);
+        void searchMaxQps();
+        LatStats* drainStats();
 
-        std::vector<uint64_t> svcTimes;
-        std::vector<uint64_t> queueTimes;
-        std::vector<uint64_t> sjrnTimes;
+        // Coordinated multi-process runs: this process generates a 1/nprocs
+        // share of the load, and rank 0 merges everyone's stats
+        int rank;
+        int nprocs;
+        std::string statsDir;
+
+        std::atomic_int nextTid;
+        std::vector<ThreadState*> threadStates;
+
+        // In-flight requests, indexed by (id & inFlightMask). A slot is
+        // claimed with a CAS and released by finiReq(), so startReq() and
+        // finiReq() never take a lock
+        size_t inFlightMask;
+        std::atomic<Request*>* inFlightReqs;
+        std::atomic<uint64_t> outstandingReqs; // Generated, not yet finished
+
+        // Recycles request buffers. Apps may write up to MAX_REQ_BYTES, so
+        // each buffer spans a full Request, but only touched pages use memory
+        BufPool bufPool;
+
+        ThreadState* getThreadState();
+
+        bool dumpRaw; // Also keep every sample and write them to lats.bin
+        bool serverQueues; // Responses report time in the server's queue
+        pthread_mutex_t statsLock; // Protects latStats registration
+        std::vector<LatStats*> latStats;
+
+        LatStats* getLatStats();
+
+        // Live telemetry, if enabled. In flight = issued - completed
+        Telemetry* telemetry;
+        std::atomic<uint64_t> issuedReqs;
+        std::atomic<uint64_t> completedReqs;
+
+        uint64_t roiStartNs; // For the throughput in lats.pct
+
+        // Request traces (see reqtrace.h), if enabled. Capture records every
+        // request the app generates; replay sends a trace's requests instead
+        // of calling the app, at the trace's arrival times if replayTiming
+        ReqTraceWriter* capture;
+        ReqTraceReader* replay;
+        bool replayTiming;
+        uint64_t genStartNs; // Arrival times in traces are relative to this
+
+        void mergeRanks(const LatStats& local, double localQps);
 
         void _startRoi();
 
     public:
         Client(int nthreads);
 
+        // With block=false, returns nullptr instead of waiting for a closed-
+        // loop user to become ready
+        Request* genReq(bool block = true);
         Request* startReq();
+        void issueReq(Request* req); // Waits for a generated req to arrive
         void finiReq(Response* resp);
 
         void startRoi();
@@ -63,19 +289,64 @@ class Client {
 
 };
 
+// Request generation is kept off the send path: generator threads build
+// requests up to lookaheadNs before they are due and hand them to the
+// dispatcher thread of their connection, which sends each at its scheduled
+// time. A slow generator or a stalled send thus never delays other requests,
+// and how late each request actually went out is recorded as its schedule lag.
 class NetworkedClient : public Client {
-    private:
-        pthread_mutex_t sendLock;
-        pthread_mutex_t recvLock;
+    protected:
+        struct Conn {
+            int fd;
+            MpmcQueue<Request*>* pending; // Generated, not yet dispatched
+            sem_t pendingReqs;
+        };
 
-        int serverFd;
+        std::vector<Conn> conns;
+        uint64_t lookaheadNs;
+        uint64_t spinNs; // How long before a send dispatchers stop sleeping
         std::string error;
 
+        // Sets up scheduling for nconns connections; the transport is left
+        // to the subclass
+        NetworkedClient(int nthreads, int nconns);
+
+        virtual bool send(int conn, Request* req);
+
     public:
-        NetworkedClient(int nthreads, std::string serverip, int serverport);
-        bool send(Request* req);
-        bool recv(Response* resp);
+        NetworkedClient(int nthreads, std::string serverip, int serverport,
+                int nconns);
+        int numConns() const { return conns.size(); }
+        void schedule(Request* req);
+        bool dispatch(int conn);
+        virtual bool recv(int conn, Response* resp);
         const std::string& errmsg() const { return error; }
 };
 
+// Talks to a server on the same host through its shared-memory segment (see
+// shm.h) rather than TCP, keeping the kernel out of the request path.
+class ShmClient : public NetworkedClient {
+    private:
+        ShmHeader* shm;
+        std::vector<ShmChannel*> channels; // One per connection
+        uint64_t spinNs; // How long recv() polls before sleeping
+
+        // A dead server never drains or fills the rings, so waits on them
+        // check on it this often
+        static const uint64_t SERVER_CHECK_NS = 100 * 1000 * 1000;
+        bool serverAlive();
+
+        bool send(int conn, Request* req);
+
+    public:
+        ShmClient(int nthreads, std::string name, int nconns);
+        bool recv(int conn, Response* resp);
+};
+
+// Runs a client process over any transport: makeClient builds the client from
+// the transport's own options, and generator, sender and receiver threads then
+// drive it until the server reports the run finished
+int runNetworkedClient(NetworkedClient* (*makeClient)(int nthreads,
+            int nconns));
+
 #endif
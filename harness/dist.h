@@ -17,28 +17,293 @@
 #ifndef __DIST_H
 #define __DIST_H
 
-#include <random>
+#include <math.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Arrival processes are shared by all client threads. Each thread draws from
+// its own random engine (its arrival sub-stream), and the Dist only holds the
+// global arrival clock, so nextArrivalNs() must be safe to call concurrently.
+typedef std::default_random_engine DistGen;
+
 class Dist {
     public:
         virtual ~Dist() {};
-        virtual uint64_t nextArrivalNs() = 0;
+        virtual uint64_t nextArrivalNs(DistGen& g) = 0;
+};
+
+// Renewal processes: interarrival gaps are iid, so it does not matter which
+// thread's sub-stream a gap came from, and the merged process has the intended
+// distribution no matter how threads interleave
+class RenewalDist : public Dist {
+    private:
+        std::atomic<uint64_t> curNs;
+
+    protected:
+        virtual double gapNs(DistGen& g) = 0;
+
+    public:
+        RenewalDist(uint64_t startNs) : curNs(startNs) {}
+
+        uint64_t nextArrivalNs(DistGen& g) {
+            uint64_t gap = gapNs(g);
+            return curNs.fetch_add(gap) + gap;
+        }
+};
+
+class ExpDist : public RenewalDist {
+    private:
+        double lambda;
+
+    protected:
+        double gapNs(DistGen& g) {
+            std::exponential_distribution<double> d(lambda);
+            return d(g);
+        }
+
+    public:
+        ExpDist(double lambda, uint64_t startNs) 
+            : RenewalDist(startNs), lambda(lambda) {}
+};
+
+class DetDist : public RenewalDist {
+    private:
+        double gap;
+
+    protected:
+        double gapNs(DistGen&) { return gap; }
+
+    public:
+        DetDist(double lambda, uint64_t startNs) 
+            : RenewalDist(startNs), gap(1.0 / lambda) {}
+};
+
+// Heavy-tailed gaps with mean 1/lambda; shape must be > 1 for the mean to exist
+class ParetoDist : public RenewalDist {
+    private:
+        double shape;
+        double scale;
+
+    protected:
+        double gapNs(DistGen& g) {
+            std::uniform_real_distribution<double> u(0.0, 1.0);
+            return scale / pow(1.0 - u(g), 1.0 / shape);
+        }
+
+    public:
+        ParetoDist(double lambda, double shape, uint64_t startNs) 
+            : RenewalDist(startNs)
+            , shape(shape)
+            , scale((shape - 1.0) / (shape * lambda)) {}
+};
+
+// Lognormal gaps with mean 1/lambda; sigma controls burstiness
+class LognormalDist : public RenewalDist {
+    private:
+        double mu;
+        double sigma;
+
+    protected:
+        double gapNs(DistGen& g) {
+            std::lognormal_distribution<double> d(mu, sigma);
+            return d(g);
+        }
+
+    public:
+        LognormalDist(double lambda, double sigma, uint64_t startNs)
+            : RenewalDist(startNs)
+            , mu(-log(lambda) - sigma * sigma / 2.0)
+            , sigma(sigma) {}
+};
+
+// Two-state Markov-modulated Poisson process. The on state runs at burst
+// times the off-state rate, and phase lengths are exponential with the given
+// means, so the long-run average rate is still lambda.
+//
+// The phase lives in the low bit of the clock word. Both the next arrival and
+// the next phase switch are exponential, hence memoryless, so a thread can
+// draw both fresh from the current state and CAS in whichever comes first.
+class MmppDist : public Dist {
+    private:
+        double rate[2];       // Arrivals per ns in {off, on}
+        double switchRate[2]; // Phase switches per ns out of {off, on}
+        std::atomic<uint64_t> state; // (clockNs << 1) | on
+
+    public:
+        MmppDist(double lambda, double burst, double onNs, double offNs, 
+                uint64_t startNs) : state(startNs << 1) {
+            double onFrac = onNs / (onNs + offNs);
+            rate[0] = lambda / (onFrac * burst + 1.0 - onFrac);
+            rate[1] = rate[0] * burst;
+            switchRate[0] = 1.0 / offNs;
+            switchRate[1] = 1.0 / onNs;
+        }
+
+        uint64_t nextArrivalNs(DistGen& g) {
+            uint64_t cur = state.load();
+            while (true) {
+                uint64_t curNs = cur >> 1;
+                int on = cur & 1;
+
+                std::exponential_distribution<double> arrival(rate[on]);
+                std::exponential_distribution<double> phaseEnd(switchRate[on]);
+                uint64_t gap = arrival(g);
+                uint64_t switchGap = phaseEnd(g);
+
+                if (switchGap < gap) {
+                    uint64_t next = ((curNs + switchGap) << 1) | (on ^ 1);
+                    if (state.compare_exchange_weak(cur, next)) cur = next;
+                } else {
+                    uint64_t next = ((curNs + gap) << 1) | on;
+                    if (state.compare_exchange_weak(cur, next)) {
+                        return curNs + gap;
+                    }
+                }
+            }
+        }
+};
+
+// Nonhomogeneous Poisson process whose rate is linearly interpolated between
+// (time, rate) points, held flat before the first and after the last point.
+// Gaps are drawn exactly by inverting the integrated rate from the current
+// clock, which is valid from any starting point because the process is
+// memoryless.
+class RampDist : public Dist {
+    private:
+        struct Point {
+            double ns;   // Relative to startNs
+            double rate; // Per ns
+        };
+
+        std::vector<Point> points;
+        uint64_t startNs;
+        std::atomic<uint64_t> curNs;
+
+        double rateAt(double t) const {
+            if (t <= points.front().ns) return points.front().rate;
+            for (size_t i = 1; i < points.size(); ++i) {
+                if (t < points[i].ns) {
+                    const Point& a = points[i - 1];
+                    const Point& b = points[i];
+                    return a.rate + (b.rate - a.rate) * (t - a.ns) / (b.ns - a.ns);
+                }
+            }
+            return points.back().rate;
+        }
+
+        // Smallest d such that the integrated rate over [t, t + d] equals mass
+        double advance(double t, double mass) const {
+            double start = t;
+            for (size_t i = 0; i <= points.size(); ++i) {
+                if (i < points.size() && t >= points[i].ns) continue;
+
+                double r = rateAt(t);
+                double slope = 0.0;
+                double segEnd = INFINITY;
+                if (i > 0 && i < points.size()) {
+                    const Point& a = points[i - 1];
+                    const Point& b = points[i];
+                    slope = (b.rate - a.rate) / (b.ns - a.ns);
+                }
+                if (i < points.size()) segEnd = points[i].ns;
+
+                double len = segEnd - t;
+                double segMass = r * len + slope * len * len / 2.0;
+                if (std::isinf(segEnd) || segMass >= mass) {
+                    // Root of r*d + slope*d^2/2 = mass, in a form that stays
+                    // accurate as slope goes to 0
+                    double d = 2.0 * mass / (r + sqrt(r * r + 2.0 * slope * mass));
+                    return t + d - start;
+                }
+
+                mass -= segMass;
+                t = segEnd;
+            }
+
+            return t - start; // Not reached: the last segment is unbounded
+        }
+
+    public:
+        // Points are (seconds since start, QPS) pairs in increasing time order
+        RampDist(const std::vector<std::pair<double, double>>& qpsPoints, 
+                uint64_t startNs) : startNs(startNs), curNs(startNs) {
+            for (auto& p : qpsPoints) {
+                Point pt = { p.first * 1e9, p.second * 1e-9 };
+                points.push_back(pt);
+            }
+        }
+
+        uint64_t nextArrivalNs(DistGen& g) {
+            std::exponential_distribution<double> d(1.0);
+            double mass = d(g);
+
+            uint64_t cur = curNs.load();
+            uint64_t next;
+            do {
+                double t = static_cast<double>(cur - startNs);
+                next = cur + static_cast<uint64_t>(advance(t, mass));
+            } while (!curNs.compare_exchange_weak(cur, next));
+
+            return next;
+        }
 };
 
-class ExpDist : public Dist {
+// Replays arrival timestamps recorded in a text file, one per line, in ns.
+// Timestamps are taken relative to the first one. When the trace runs out it
+// loops, with one mean gap between the last arrival and the repeat of the first.
+// With several client processes, each replays every nprocs-th arrival.
+class TraceDist : public Dist {
     private:
-        std::default_random_engine g;
-        std::exponential_distribution<double> d;
-        uint64_t curNs;
+        std::vector<uint64_t> offsetsNs;
+        uint64_t periodNs;
+        uint64_t startNs;
+        int rank;
+        int nprocs;
+        std::atomic<uint64_t> nextIdx;
 
     public:
-        ExpDist(double lambda, uint64_t seed, uint64_t startNs) 
-            : g(seed), d(lambda), curNs(startNs) {}
+        TraceDist(const std::string& traceFile, uint64_t startNs, int rank = 0,
+                int nprocs = 1) 
+            : startNs(startNs), rank(rank), nprocs(nprocs), nextIdx(0) {
+            std::ifstream in(traceFile.c_str());
+            if (!in.is_open()) {
+                std::cerr << "Could not open arrival trace " << traceFile \
+                    << std::endl;
+                exit(-1);
+            }
+
+            uint64_t ts;
+            while (in >> ts) {
+                if (!offsetsNs.empty() && ts < offsetsNs.back()) {
+                    std::cerr << "Arrival trace " << traceFile \
+                        << " is not sorted" << std::endl;
+                    exit(-1);
+                }
+                offsetsNs.push_back(ts);
+            }
+
+            if (offsetsNs.size() < 2) {
+                std::cerr << "Arrival trace " << traceFile \
+                    << " needs at least 2 arrivals" << std::endl;
+                exit(-1);
+            }
+
+            uint64_t first = offsetsNs.front();
+            for (uint64_t& o : offsetsNs) o -= first;
+            uint64_t span = offsetsNs.back();
+            periodNs = span + span / (offsetsNs.size() - 1);
+        }
 
-        uint64_t nextArrivalNs() {
-            curNs += d(g);
-            return curNs;
+        uint64_t nextArrivalNs(DistGen&) {
+            uint64_t idx = nextIdx++ * nprocs + rank;
+            uint64_t n = offsetsNs.size();
+            return startNs + (idx / n) * periodNs + offsetsNs[idx % n];
         }
 };
 
@@ -18,18 +18,27 @@
 #define __HELPERS_H
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <iostream>
 #include <sstream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 template<typename T>
 static T getOpt(const char* name, T defVal) {
     const char* opt = getenv(name);
 
-    std::cout << name << " = " << opt << std::endl;
+    // Streaming a null char* puts std::cout in a failed state for good
+    std::cout << name << " = " << (opt ? opt : "") << std::endl;
     if (!opt) return defVal;
     std::stringstream ss(opt);
     if (ss.str().length() == 0) return defVal;
@@ -43,11 +52,108 @@ static T getOpt(const char* name, T defVal) {
     return res;
 }
 
+// Process-wide timestamp source, in ns on the CLOCK_MONOTONIC timeline. When
+// the CPU has an invariant TSC (constant rate, ticks through C-states), reads
+// the TSC and scales it with a ratio calibrated once against CLOCK_MONOTONIC;
+// otherwise, or with TBENCH_CLOCK=monotonic, reads CLOCK_MONOTONIC directly.
+// Either way, stamps never go backwards when the wall clock is stepped or
+// slewed. Timestamps are only comparable within a process.
+class Clock {
+    private:
+        static const uint64_t CALIB_NS = 20*1000*1000;
+        static const int FRAC_BITS = 32; // ns per tick, in 32.32 fixed point
+
+        bool useTsc;
+        uint64_t baseTsc;
+        uint64_t baseNs;
+        uint64_t nsPerTick;
+
+        static uint64_t monotonicNs() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec*1000*1000*1000ul + ts.tv_nsec;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        static uint64_t rdtsc() {
+            uint32_t a, d;
+            asm volatile("rdtsc" : "=a" (a), "=d" (d));
+            return (static_cast<uint64_t>(d) << 32) | a;
+        }
+
+        static bool hasInvariantTsc() {
+            unsigned a, b, c, d;
+            if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) return false;
+            return d & (1 << 8);
+        }
+
+        // Pairs a CLOCK_MONOTONIC reading with the TSC value taken midway
+        // through it, keeping the tightest of a few tries
+        static void sample(uint64_t* tsc, uint64_t* ns) {
+            uint64_t best = UINT64_MAX;
+            for (int i = 0; i < 8; ++i) {
+                uint64_t before = rdtsc();
+                uint64_t t = monotonicNs();
+                uint64_t after = rdtsc();
+                if (after - before < best) {
+                    best = after - before;
+                    *tsc = before + (after - before) / 2;
+                    *ns = t;
+                }
+            }
+        }
+#else
+        static uint64_t rdtsc() { return 0; }
+        static bool hasInvariantTsc() { return false; }
+        static void sample(uint64_t* tsc, uint64_t* ns) {
+            *tsc = 0;
+            *ns = monotonicNs();
+        }
+#endif
+
+        Clock() : useTsc(false), baseTsc(0), baseNs(0), nsPerTick(0) {
+            std::string src = getOpt<std::string>("TBENCH_CLOCK", "tsc");
+            if (src != "tsc" && src != "monotonic") {
+                std::cerr << "Unknown TBENCH_CLOCK " << src << std::endl;
+                exit(-1);
+            }
+
+            if (src == "tsc" && hasInvariantTsc()) {
+                uint64_t endTsc = 0, endNs = 0;
+                sample(&baseTsc, &baseNs);
+                struct timespec ts = {0, (long)CALIB_NS};
+                nanosleep(&ts, NULL);
+                sample(&endTsc, &endNs);
+
+                if (endTsc > baseTsc) {
+                    nsPerTick = ((endNs - baseNs) << FRAC_BITS) /
+                        (endTsc - baseTsc);
+                    useTsc = true;
+                }
+            }
+
+            if (src == "tsc" && !useTsc) {
+                std::cerr << "No invariant TSC, timing with CLOCK_MONOTONIC"
+                    << std::endl;
+            }
+        }
+
+    public:
+        static const Clock& get() {
+            static Clock clock; // One calibration per process
+            return clock;
+        }
+
+        uint64_t now() const {
+            if (!useTsc) return monotonicNs();
+            unsigned __int128 ticks = rdtsc() - baseTsc;
+            return baseNs + static_cast<uint64_t>((ticks * nsPerTick) >>
+                    FRAC_BITS);
+        }
+};
+
 static uint64_t getCurNs() {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    uint64_t t = ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
-    return t;
+    return Clock::get().now();
 }
 
 static void sleepUntil(uint64_t targetNs) {
@@ -85,7 +191,7 @@ static int recvfull(int fd, char* msg, int len, int flags) {
     int recvd;
 
     while (remaining > 0) {
-        recvd = recv(fd, reinterpret_cast<void*>(cur), len, flags);
+        recvd = recv(fd, reinterpret_cast<void*>(cur), remaining, flags);
         if ((recvd == -1) || (recvd == 0)) break;
         cur += recvd;
         remaining -= recvd;
@@ -0,0 +1,198 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __HIST_H
+#define __HIST_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <random>
+
+// Fixed-size, log-bucketed latency histogram in the style of HdrHistogram.
+// Values below SUB_BUCKETS are counted exactly; above that, each power of two
+// is split into SUB_BUCKETS/2 linear buckets, bounding the relative error of
+// any reported percentile to 2/SUB_BUCKETS (< 1%). Recording is a couple of
+// shifts and an increment, and memory does not grow with the number of samples.
+class Histogram {
+    public:
+        static const int SUB_BITS = 8;
+        static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+        static const uint64_t HALF = SUB_BUCKETS / 2;
+        static const int NBUCKETS = (66 - SUB_BITS) * HALF;
+
+    private:
+        uint64_t counts[NBUCKETS];
+        uint64_t total;
+        uint64_t sum;
+        uint64_t minVal;
+        uint64_t maxVal;
+
+        static int bucketOf(uint64_t v) {
+            if (v < SUB_BUCKETS) return v;
+            int msb = 63 - __builtin_clzll(v);
+            int shift = msb - SUB_BITS + 1;
+            return (shift + 1) * HALF + ((v >> shift) - HALF);
+        }
+
+        static uint64_t bucketLow(int b) {
+            if (b < (int)SUB_BUCKETS) return b;
+            int shift = b / HALF - 1;
+            return (b % HALF + HALF) << shift;
+        }
+
+        static uint64_t bucketHigh(int b) {
+            if (b < (int)SUB_BUCKETS) return b;
+            int shift = b / HALF - 1;
+            return ((b % HALF + HALF + 1) << shift) - 1;
+        }
+
+    public:
+        Histogram() { reset(); }
+
+        void reset() {
+            memset(counts, 0, sizeof(counts));
+            total = 0;
+            sum = 0;
+            minVal = UINT64_MAX;
+            maxVal = 0;
+        }
+
+        void record(uint64_t v) {
+            ++counts[bucketOf(v)];
+            ++total;
+            sum += v;
+            minVal = std::min(minVal, v);
+            maxVal = std::max(maxVal, v);
+        }
+
+        void merge(const Histogram& other) {
+            for (int b = 0; b < NBUCKETS; ++b) counts[b] += other.counts[b];
+            total += other.total;
+            sum += other.sum;
+            minVal = std::min(minVal, other.minVal);
+            maxVal = std::max(maxVal, other.maxVal);
+        }
+
+        // Serialized as the summary fields followed by (bucket, count) pairs
+        // for the nonzero buckets, so histograms from several processes can
+        // be merged after the fact
+        void write(std::ostream& out) const {
+            uint64_t nonzero = 0;
+            for (int b = 0; b < NBUCKETS; ++b) nonzero += (counts[b] != 0);
+
+            uint64_t hdr[5] = { total, sum, minVal, maxVal, nonzero };
+            out.write(reinterpret_cast<const char*>(hdr), sizeof(hdr));
+            for (int b = 0; b < NBUCKETS; ++b) {
+                if (!counts[b]) continue;
+                uint64_t pair[2] = { (uint64_t)b, counts[b] };
+                out.write(reinterpret_cast<const char*>(pair), sizeof(pair));
+            }
+        }
+
+        bool read(std::istream& in) {
+            reset();
+
+            uint64_t hdr[5];
+            if (!in.read(reinterpret_cast<char*>(hdr), sizeof(hdr))) {
+                return false;
+            }
+            total = hdr[0];
+            sum = hdr[1];
+            minVal = hdr[2];
+            maxVal = hdr[3];
+
+            for (uint64_t i = 0; i < hdr[4]; ++i) {
+                uint64_t pair[2];
+                if (!in.read(reinterpret_cast<char*>(pair), sizeof(pair)) ||
+                        pair[0] >= (uint64_t)NBUCKETS) {
+                    return false;
+                }
+                counts[pair[0]] = pair[1];
+            }
+
+            return true;
+        }
+
+        uint64_t count() const { return total; }
+        uint64_t min() const { return total ? minVal : 0; }
+        uint64_t max() const { return maxVal; }
+        double mean() const { return total ? (double)sum / total : 0.0; }
+
+        // Nearest-rank value at percentile pct (0-100), reported as the
+        // midpoint of the bucket holding that rank, clamped to the observed
+        // min and max
+        uint64_t percentile(double pct) const {
+            if (total == 0) return 0;
+
+            uint64_t rank = (uint64_t)ceil(pct / 100.0 * total);
+            rank = std::max<uint64_t>(1, std::min(rank, total));
+
+            uint64_t seen = 0;
+            for (int b = 0; b < NBUCKETS; ++b) {
+                seen += counts[b];
+                if (seen >= rank) {
+                    uint64_t mid = bucketLow(b) +
+                        (bucketHigh(b) - bucketLow(b)) / 2;
+                    return std::max(minVal, std::min(mid, maxVal));
+                }
+            }
+
+            return maxVal;
+        }
+
+        // Calls f(low, high, count) for each nonempty bucket, in order
+        template<typename F>
+        void forEachBucket(F f) const {
+            for (int b = 0; b < NBUCKETS; ++b) {
+                if (counts[b]) f(bucketLow(b), bucketHigh(b), counts[b]);
+            }
+        }
+
+        // Sets out to a bootstrap resample of this histogram: count() values
+        // drawn with replacement from the recorded ones. Draws bucket counts
+        // from the multinomial directly, so it takes time proportional to
+        // the number of buckets in use, not of values.
+        template<typename G>
+        void resample(G& gen, Histogram* out) const {
+            out->reset();
+            uint64_t left = total; // Draws not yet assigned to a bucket
+            uint64_t mass = total; // Recorded values in buckets b and up
+            for (int b = 0; b < NBUCKETS && left; ++b) {
+                if (!counts[b]) continue;
+
+                // Of the draws left, each lands in b with this probability
+                double p = std::min(1.0, (double)counts[b] / mass);
+                std::binomial_distribution<uint64_t> draw(left, p);
+                uint64_t n = draw(gen);
+
+                out->counts[b] = n;
+                out->sum += n * (bucketLow(b) + (bucketHigh(b) - 
+                            bucketLow(b)) / 2);
+                left -= n;
+                mass -= counts[b];
+            }
+            out->total = total;
+            out->minVal = minVal;
+            out->maxVal = maxVal;
+        }
+};
+
+#endif
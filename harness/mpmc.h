@@ -0,0 +1,104 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __MPMC_H
+#define __MPMC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov's design).
+// Each cell carries a sequence number that tells producers and consumers
+// whether it is free for the current lap, so push and pop each cost one CAS on
+// the shared position plus one store to the cell.
+template<typename T>
+class MpmcQueue {
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            T val;
+        };
+
+        Cell* cells;
+        size_t mask;
+
+        char pad0[64];
+        std::atomic<size_t> head; // Next position to pop
+        char pad1[64];
+        std::atomic<size_t> tail; // Next position to push
+        char pad2[64];
+
+    public:
+        // capacity is rounded up to a power of 2
+        MpmcQueue(size_t capacity) : head(0), tail(0) {
+            size_t size = 2;
+            while (size < capacity) size <<= 1;
+            mask = size - 1;
+            cells = new Cell[size];
+            for (size_t i = 0; i < size; ++i) cells[i].seq = i;
+        }
+
+        ~MpmcQueue() { delete[] cells; }
+
+        // Returns false if the queue is full
+        bool push(const T& val) {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            while (true) {
+                Cell* cell = &cells[pos & mask];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1,
+                                std::memory_order_relaxed)) {
+                        cell->val = val;
+                        cell->seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Returns false if the queue is empty
+        bool pop(T* val) {
+            size_t pos = head.load(std::memory_order_relaxed);
+            while (true) {
+                Cell* cell = &cells[pos & mask];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos, pos + 1,
+                                std::memory_order_relaxed)) {
+                        *val = cell->val;
+                        cell->seq.store(pos + mask + 1,
+                                std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+};
+
+#endif
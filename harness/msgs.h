@@ -23,11 +23,18 @@
 const int MAX_REQ_BYTES = 1 << 20; // 1 MB
 const int MAX_RESP_BYTES = 1 << 20; // 1 MB
 
-enum ResponseType { RESPONSE, ROI_BEGIN, FINISH };
+// SHED answers a request the server dropped instead of serving
+enum ResponseType { RESPONSE, ROI_BEGIN, FINISH, SHED };
+
+// Request::budgetNs of requests without a deadline
+const uint64_t NO_DEADLINE = UINT64_MAX;
 
 struct Request {
     uint64_t id;
     uint64_t genNs;
+    uint64_t budgetNs; // Time left to the deadline when sent. Relative, since
+                       // client and server clocks are not comparable
+    uint32_t cls; // Class tag from tBenchClientSetReqClass(), 0 if untagged
     size_t len;
     char data[MAX_REQ_BYTES];
 };
@@ -36,8 +43,14 @@ struct Response {
     ResponseType type;
     uint64_t id;
     uint64_t svcNs;
+    uint64_t waitNs; // Part of the queueing time spent in the server's queue
     size_t len;
     char data[MAX_RESP_BYTES];
 };
 
+// Messages travel as a header followed by only len bytes of payload, and are
+// allocated to match; the full MAX_*_BYTES structs are never materialized
+const size_t REQ_HDR_BYTES = sizeof(Request) - MAX_REQ_BYTES;
+const size_t RESP_HDR_BYTES = sizeof(Response) - MAX_RESP_BYTES;
+
 #endif
@@ -0,0 +1,329 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PERFCTR_H
+#define __PERFCTR_H
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Hardware and OS event counts per request, to see what sets slow requests
+// apart from typical ones. Each app thread opens its own counters with
+// perf_event_open() and reads them when it gets a batch of requests and when
+// it answers them; the difference, split evenly over the responses, is charged
+// to each request and summed by service time (one bucket per power of two ns).
+// Counters are read with one read() per group, so they cost a couple of
+// syscalls per batch; with many more hardware events than the CPU has
+// counters, the kernel multiplexes the group and counts are unreliable.
+class PerfCounters {
+    public:
+        static const int MAX_EVENTS = 16;
+        static const int NBUCKETS = 64;
+
+    private:
+        struct EventDesc {
+            const char* name; // As in perf list
+            uint32_t type;
+            uint64_t config;
+        };
+
+        static const EventDesc* eventTable(size_t* n) {
+            static const uint64_t READ_MISS =
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            static const EventDesc table[] = {
+                { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                { "instructions", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_INSTRUCTIONS },
+                { "cache-references", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_CACHE_REFERENCES },
+                { "cache-misses", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_CACHE_MISSES },
+                { "branches", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+                { "branch-misses", PERF_TYPE_HARDWARE,
+                    PERF_COUNT_HW_BRANCH_MISSES },
+                { "L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+                    PERF_COUNT_HW_CACHE_L1D | READ_MISS },
+                { "LLC-load-misses", PERF_TYPE_HW_CACHE,
+                    PERF_COUNT_HW_CACHE_LL | READ_MISS },
+                { "dTLB-load-misses", PERF_TYPE_HW_CACHE,
+                    PERF_COUNT_HW_CACHE_DTLB | READ_MISS },
+                { "iTLB-load-misses", PERF_TYPE_HW_CACHE,
+                    PERF_COUNT_HW_CACHE_ITLB | READ_MISS },
+                { "context-switches", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_CONTEXT_SWITCHES },
+                { "cpu-migrations", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_CPU_MIGRATIONS },
+                { "page-faults", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_PAGE_FAULTS },
+            };
+            *n = sizeof(table) / sizeof(table[0]);
+            return table;
+        }
+
+        // Counters read together. Hardware and software events go in separate
+        // groups, since the kernel schedules a group on one PMU.
+        struct Group {
+            int leaderFd;
+            std::vector<int> events; // Indices into this->events, in fd order
+        };
+
+        // State of one app thread. Only the owner writes it; write() reads
+        // it from another thread, which at worst misses the last request.
+        struct Thread {
+            std::vector<Group> groups;
+            uint64_t snap[MAX_EVENTS]; // Counts at the last read
+            uint64_t share[MAX_EVENTS]; // Per response, from stop()
+            bool multiplexed; // Some group did not count all the time
+
+            uint64_t reqs[NBUCKETS];
+            uint64_t sums[NBUCKETS][MAX_EVENTS];
+        };
+
+        std::vector<const EventDesc*> events;
+        bool excludeKernel;
+        std::vector<Thread*> threads;
+        std::atomic<bool> active; // Only requests in the ROI are charged
+
+        int open(const EventDesc* ev, int groupFd, bool excludeKernel) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = ev->type;
+            attr.config = ev->config;
+            attr.read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = excludeKernel;
+            attr.exclude_hv = 1;
+
+            // This thread, on any CPU
+            return syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+        }
+
+        // Reads every group of thread t into vals, in event order
+        void readAll(Thread* t, uint64_t* vals) {
+            uint64_t buf[3 + MAX_EVENTS];
+            for (Group& g : t->groups) {
+                ssize_t bytes = read(g.leaderFd, buf, sizeof(buf));
+                if (bytes < (ssize_t)(3 * sizeof(uint64_t))) {
+                    std::cerr << "Reading perf counters failed: " \
+                        << strerror(errno) << std::endl;
+                    exit(-1);
+                }
+
+                // { nr, time_enabled, time_running, values[nr] }
+                if (buf[2] < buf[1]) t->multiplexed = true;
+                for (size_t i = 0; i < g.events.size(); ++i) {
+                    vals[g.events[i]] = buf[3 + i];
+                }
+            }
+        }
+
+        static int bucketOf(uint64_t svcNs) {
+            return svcNs ? 63 - __builtin_clzll(svcNs) : 0;
+        }
+
+    public:
+        // Probes the events in names (comma-separated) on the calling thread
+        // and keeps those the kernel and CPU support, warning about the rest
+        PerfCounters(const std::string& names, int nthreads)
+            : excludeKernel(false)
+            , threads(nthreads, nullptr)
+        {
+            size_t ntable;
+            const EventDesc* table = eventTable(&ntable);
+
+            std::stringstream ss(names);
+            std::string name;
+            while (std::getline(ss, name, ',')) {
+                const EventDesc* ev = nullptr;
+                for (size_t e = 0; e < ntable; ++e) {
+                    if (name == table[e].name) ev = &table[e];
+                }
+                if (!ev) {
+                    std::cerr << "Unknown perf event " << name << std::endl;
+                    exit(-1);
+                }
+                if (events.size() == MAX_EVENTS) {
+                    std::cerr << "At most " << MAX_EVENTS << " perf events" \
+                        << std::endl;
+                    exit(-1);
+                }
+
+                int fd = open(ev, -1, excludeKernel);
+                if (fd == -1 && (errno == EACCES || errno == EPERM) &&
+                        !excludeKernel) {
+                    // perf_event_paranoid may still allow user-mode counts
+                    fd = open(ev, -1, true);
+                    if (fd != -1) {
+                        std::cerr << "WARNING: Not allowed to count kernel " \
+                            << "events, counting user mode only" << std::endl;
+                        excludeKernel = true;
+                    }
+                }
+                if (fd == -1) {
+                    std::cerr << "WARNING: Cannot count perf event " << name \
+                        << ": " << strerror(errno) << ", skipping" \
+                        << std::endl;
+                    continue;
+                }
+                close(fd);
+                events.push_back(ev);
+            }
+
+            active = false;
+        }
+
+        size_t numEvents() const { return events.size(); }
+
+        // Opens the counters for thread id, which must be the calling thread
+        void threadStart(int id) {
+            Thread* t = new Thread();
+            memset(t->reqs, 0, sizeof(t->reqs));
+            memset(t->sums, 0, sizeof(t->sums));
+            t->multiplexed = false;
+
+            int hwGroup = -1;
+            int swGroup = -1;
+            for (size_t e = 0; e < events.size(); ++e) {
+                bool sw = (events[e]->type == PERF_TYPE_SOFTWARE);
+                int& g = sw ? swGroup : hwGroup;
+
+                int leaderFd = (g == -1) ? -1 : t->groups[g].leaderFd;
+                int fd = open(events[e], leaderFd, excludeKernel);
+                if (fd == -1) {
+                    std::cerr << "Could not open perf event " \
+                        << events[e]->name << ": " << strerror(errno) \
+                        << std::endl;
+                    exit(-1);
+                }
+
+                if (g == -1) {
+                    g = t->groups.size();
+                    Group group = { fd, std::vector<int>() };
+                    t->groups.push_back(group);
+                }
+                t->groups[g].events.push_back(e);
+            }
+
+            readAll(t, t->snap);
+            threads[id] = t;
+        }
+
+        // Counting starts with the ROI, and stops with it
+        void setActive(bool a) { active = a; }
+
+        // Thread id got a batch of requests
+        void start(int id) {
+            Thread* t = threads[id];
+            if (t) readAll(t, t->snap);
+        }
+
+        // Thread id is about to answer n requests: what it counted since the
+        // last read is split over them
+        void stop(int id, size_t n) {
+            Thread* t = threads[id];
+            if (!t) return;
+
+            uint64_t vals[MAX_EVENTS];
+            readAll(t, vals);
+            for (size_t e = 0; e < events.size(); ++e) {
+                t->share[e] = (vals[e] - t->snap[e]) / n;
+                t->snap[e] = vals[e];
+            }
+        }
+
+        // Charges one response's share from the last stop() to its request
+        void record(int id, uint64_t svcNs) {
+            Thread* t = threads[id];
+            if (!t || !active) return;
+
+            int b = bucketOf(svcNs);
+            ++t->reqs[b];
+            for (size_t e = 0; e < events.size(); ++e) {
+                t->sums[b][e] += t->share[e];
+            }
+        }
+
+        // Writes one row per nonempty service-time bucket and one for all
+        // requests, with the mean of each event per request
+        void write(const std::string& path) {
+            uint64_t reqs[NBUCKETS + 1];
+            uint64_t sums[NBUCKETS + 1][MAX_EVENTS];
+            memset(reqs, 0, sizeof(reqs));
+            memset(sums, 0, sizeof(sums));
+
+            bool multiplexed = false;
+            for (Thread* t : threads) {
+                if (!t) continue;
+                multiplexed |= t->multiplexed;
+                for (int b = 0; b < NBUCKETS; ++b) {
+                    reqs[b] += t->reqs[b];
+                    reqs[NBUCKETS] += t->reqs[b];
+                    for (size_t e = 0; e < events.size(); ++e) {
+                        sums[b][e] += t->sums[b][e];
+                        sums[NBUCKETS][e] += t->sums[b][e];
+                    }
+                }
+            }
+
+            std::ofstream out(path.c_str());
+            if (!out.is_open()) {
+                std::cerr << "Could not open " << path << std::endl;
+                return;
+            }
+
+            out << "svc_min_ns,svc_max_ns,reqs";
+            for (const EventDesc* ev : events) out << "," << ev->name;
+            out << std::endl;
+
+            out << std::fixed << std::setprecision(3);
+            for (int b = 0; b <= NBUCKETS; ++b) {
+                if (!reqs[b]) continue;
+                if (b < NBUCKETS) {
+                    uint64_t lo = b ? (1ULL << b) : 0;
+                    out << lo << "," << (1ULL << b << 1) - 1;
+                } else {
+                    out << "all,all";
+                }
+                out << "," << reqs[b];
+                for (size_t e = 0; e < events.size(); ++e) {
+                    out << "," << (double)sums[b][e] / reqs[b];
+                }
+                out << std::endl;
+            }
+
+            if (multiplexed) {
+                std::cerr << "WARNING: perf counters were multiplexed; use " \
+                    << "fewer hardware events for exact counts" << std::endl;
+            }
+        }
+};
+
+#endif
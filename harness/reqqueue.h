@@ -0,0 +1,103 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __REQQUEUE_H
+#define __REQQUEUE_H
+
+#include "mpmc.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue of requests waiting for an app
+// thread. Requests are served either first-come first-served, or in order of
+// a key given when they are pushed (lowest first, ties in arrival order).
+// FCFS is lock-free; keyed order takes a lock around a heap, which is cheap
+// next to a request's service time.
+template<typename T>
+class ReqQueue {
+    private:
+        struct Entry {
+            uint64_t key;
+            uint64_t seq;
+            T val;
+
+            bool operator>(const Entry& other) const {
+                return (key != other.key) ? (key > other.key) :
+                    (seq > other.seq);
+            }
+        };
+
+        size_t capacity;
+        bool keyed;
+
+        MpmcQueue<T>* fifo; // If FCFS
+
+        // If keyed
+        pthread_mutex_t lock;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>
+            heap;
+        uint64_t nextSeq;
+
+    public:
+        ReqQueue(size_t capacity, bool keyed)
+            : capacity(capacity)
+            , keyed(keyed)
+            , fifo(nullptr)
+            , nextSeq(0)
+        {
+            if (keyed) {
+                pthread_mutex_init(&lock, nullptr);
+            } else {
+                fifo = new MpmcQueue<T>(capacity);
+            }
+        }
+
+        // Returns false if the queue is full. key is ignored under FCFS.
+        bool push(const T& val, uint64_t key) {
+            if (!keyed) return fifo->push(val);
+
+            pthread_mutex_lock(&lock);
+            bool pushed = (heap.size() < capacity);
+            if (pushed) {
+                Entry e = { key, nextSeq++, val };
+                heap.push(e);
+            }
+            pthread_mutex_unlock(&lock);
+            return pushed;
+        }
+
+        // Returns false if the queue is empty
+        bool pop(T* val) {
+            if (!keyed) return fifo->pop(val);
+
+            pthread_mutex_lock(&lock);
+            bool popped = !heap.empty();
+            if (popped) {
+                *val = heap.top().val;
+                heap.pop();
+            }
+            pthread_mutex_unlock(&lock);
+            return popped;
+        }
+};
+
+#endif
@@ -0,0 +1,221 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __REQTRACE_H
+#define __REQTRACE_H
+
+#include "msgs.h"
+#include "tbench_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Request traces: the exact stream of requests a client generated, so later
+// runs can send the same payloads at the same times without running the app's
+// request generator. A trace is a fixed header followed by one record per
+// request, in the order they were generated; records are 8-byte aligned so a
+// mapped trace can be read in place.
+
+static const uint64_t REQ_TRACE_MAGIC = 0x7462747261636531ULL; // "tbtrace1"
+static const size_t REQ_TRACE_NAME_BYTES = 32;
+
+struct ReqTraceHeader {
+    uint64_t magic;
+    uint64_t classesUsed; // The app tagged requests with classes
+    char classNames[TBENCH_MAX_REQ_CLASSES][REQ_TRACE_NAME_BYTES];
+};
+
+struct ReqTraceRecord {
+    uint64_t offsetNs; // Arrival time, from the start of the run
+    uint32_t cls;
+    uint32_t len;
+    char data[0]; // len bytes, then padding to 8 bytes
+
+    size_t size() const { return (sizeof(ReqTraceRecord) + len + 7) & ~7ULL; }
+};
+
+// Appends records through a buffer, so capturing costs a memcpy per request
+// and a write() every few MB. Not thread-safe; the client serializes calls.
+class ReqTraceWriter {
+    private:
+        static const size_t BUF_BYTES = 4 << 20;
+
+        int fd;
+        std::string path;
+        std::vector<char> buf;
+
+        void writeAll(const char* data, size_t len) {
+            while (len) {
+                ssize_t written = write(fd, data, len);
+                if (written == -1) {
+                    if (errno == EINTR) continue;
+                    std::cerr << "Writing request trace " << path \
+                        << " failed: " << strerror(errno) << std::endl;
+                    exit(-1);
+                }
+                data += written;
+                len -= written;
+            }
+        }
+
+    public:
+        ReqTraceWriter(const std::string& path) : path(path) {
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                std::cerr << "Could not create request trace " << path \
+                    << ": " << strerror(errno) << std::endl;
+                exit(-1);
+            }
+
+            // Filled in by flush()
+            ReqTraceHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            writeAll(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+            buf.reserve(BUF_BYTES);
+        }
+
+        void append(uint64_t offsetNs, unsigned cls, const char* data,
+                size_t len) {
+            ReqTraceRecord rec;
+            rec.offsetNs = offsetNs;
+            rec.cls = cls;
+            rec.len = len;
+
+            size_t pos = buf.size();
+            buf.resize(pos + rec.size(), 0);
+            memcpy(&buf[pos], &rec, sizeof(rec));
+            memcpy(&buf[pos + sizeof(rec)], data, len);
+
+            if (buf.size() >= BUF_BYTES) {
+                writeAll(buf.data(), buf.size());
+                buf.clear();
+            }
+        }
+
+        // Writes out buffered records and the header, leaving a complete
+        // trace on disk. Capture may continue afterwards.
+        void flush(bool classesUsed, const std::string* classNames) {
+            writeAll(buf.data(), buf.size());
+            buf.clear();
+
+            ReqTraceHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = REQ_TRACE_MAGIC;
+            hdr.classesUsed = classesUsed;
+            for (int c = 0; c < TBENCH_MAX_REQ_CLASSES; ++c) {
+                strncpy(hdr.classNames[c], classNames[c].c_str(),
+                        REQ_TRACE_NAME_BYTES - 1);
+            }
+            if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+                std::cerr << "Writing request trace " << path << " failed: " \
+                    << strerror(errno) << std::endl;
+                exit(-1);
+            }
+        }
+};
+
+// Maps a trace and hands out its records, striped across client processes
+// like arrival traces (see TraceDist) and looping when it runs out. Each loop
+// is shifted by the trace's span plus one mean interarrival gap.
+class ReqTraceReader {
+    private:
+        const ReqTraceHeader* hdr;
+        std::vector<const ReqTraceRecord*> recs;
+        uint64_t periodNs;
+        int rank;
+        int nprocs;
+        std::atomic<uint64_t> nextIdx;
+
+    public:
+        ReqTraceReader(const std::string& path, int rank, int nprocs)
+            : rank(rank), nprocs(nprocs), nextIdx(0)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) == -1) {
+                std::cerr << "Could not open request trace " << path \
+                    << ": " << strerror(errno) << std::endl;
+                exit(-1);
+            }
+
+            size_t len = st.st_size;
+            void* base = (len < sizeof(ReqTraceHeader)) ? MAP_FAILED :
+                mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            hdr = reinterpret_cast<const ReqTraceHeader*>(base);
+            if (base == MAP_FAILED || hdr->magic != REQ_TRACE_MAGIC) {
+                std::cerr << path << " is not a complete request trace" \
+                    << std::endl;
+                exit(-1);
+            }
+            madvise(base, len, MADV_WILLNEED);
+
+            // A record cut short by a capture that did not finish is dropped
+            const char* pos = reinterpret_cast<const char*>(hdr + 1);
+            const char* end = reinterpret_cast<const char*>(base) + len;
+            uint64_t spanNs = 0;
+            while (pos + sizeof(ReqTraceRecord) <= end) {
+                const ReqTraceRecord* rec =
+                    reinterpret_cast<const ReqTraceRecord*>(pos);
+                if (rec->len > (uint32_t)MAX_REQ_BYTES ||
+                        pos + rec->size() > end) {
+                    break;
+                }
+                recs.push_back(rec);
+                spanNs = std::max(spanNs, rec->offsetNs);
+                pos += rec->size();
+            }
+
+            if (recs.size() < 2) {
+                std::cerr << "Request trace " << path \
+                    << " needs at least 2 requests" << std::endl;
+                exit(-1);
+            }
+            periodNs = spanNs + spanNs / (recs.size() - 1);
+        }
+
+        bool classesUsed() const { return hdr->classesUsed; }
+
+        // Empty if the class was never named
+        std::string className(int cls) const {
+            const char* name = hdr->classNames[cls];
+            return std::string(name, strnlen(name, REQ_TRACE_NAME_BYTES));
+        }
+
+        // Claims the next record, and sets *offsetNs to its arrival time
+        // from the start of the run
+        const ReqTraceRecord* next(uint64_t* offsetNs) {
+            uint64_t idx = nextIdx++ * nprocs + rank;
+            uint64_t n = recs.size();
+            const ReqTraceRecord* rec = recs[idx % n];
+            *offsetNs = (idx / n) * periodNs + rec->offsetNs;
+            return rec;
+        }
+};
+
+#endif
@@ -17,15 +17,36 @@
 #ifndef __SERVER_H
 #define __SERVER_H
 
+#include "bufpool.h"
 #include "client.h"
 #include "dist.h"
 #include "helpers.h"
+#include "mpmc.h"
 #include "msgs.h"
+#include "perfctr.h"
+#include "reqqueue.h"
+#include "shm.h"
+#include "steady.h"
+#include "tbench_client.h"
+#include "tbench_server.h"
+#include "telemetry.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
 
 class Server {
@@ -33,62 +54,753 @@ class Server {
         struct ReqInfo {
             uint64_t id;
             uint64_t startNs;
+            uint64_t waitNs; // In the server's queue, if it has one
+            int tid; // Thread that took it, for async requests
         };
 
-        uint64_t finishedReqs;
+        std::atomic<uint64_t> finishedReqs;
         uint64_t maxReqs;
         uint64_t warmupReqs;
 
-        std::vector<ReqInfo> reqInfo; // Request info for each thread 
+        // Info on the requests each thread got from its last recvReqBatch(),
+        // indexed by the handles it returned
+        std::vector<std::vector<ReqInfo>> reqInfo;
+
+        ReqInfo& getReqInfo(int id, uint64_t handle) {
+            if (handle >= reqInfo[id].size()) {
+                std::cerr << "ERROR! Response to unknown request handle " \
+                    << handle << std::endl;
+                exit(-1);
+            }
+            return reqInfo[id][handle];
+        }
+
+        // Requests taken through the asynchronous API, which any thread may
+        // answer at any time. A handle indexes asyncInfo for as long as its
+        // request is outstanding; handles not in use wait in asyncFree.
+        // Threads that found none left sleep on asyncFreed until one is
+        // returned.
+        static const uint64_t MAX_ASYNC_REQS = 1 << 16;
+        std::vector<ReqInfo> asyncInfo;
+        MpmcQueue<uint64_t> asyncFree;
+        std::atomic<int> asyncWaiters;
+        sem_t asyncFreed;
+
+        // Returns false if MAX_ASYNC_REQS requests are already outstanding
+        bool allocAsync(uint64_t* handle) { return asyncFree.pop(handle); }
+
+        void freeAsync(uint64_t handle) {
+            asyncFree.push(handle);
+            if (asyncWaiters) sem_post(&asyncFreed);
+        }
+
+        // Blocks until a handle may be free. A waiter counts itself before
+        // checking, so a handle returned after the check always wakes it.
+        void waitAsyncFree() {
+            ++asyncWaiters;
+            uint64_t handle;
+            if (asyncFree.pop(&handle)) asyncFree.push(handle);
+            else sem_wait(&asyncFreed);
+            --asyncWaiters;
+        }
+
+        ReqInfo& getAsyncInfo(uint64_t handle) {
+            if (handle >= MAX_ASYNC_REQS) {
+                std::cerr << "ERROR! Response to unknown async request " \
+                    << "handle " << handle << std::endl;
+                exit(-1);
+            }
+            return asyncInfo[handle];
+        }
+
+        // Fills in the response header for a request, stamping its service
+        // time as of curNs
+        static void fillResp(Response* resp, const ReqInfo& info, size_t len,
+                uint64_t curNs) {
+            resp->type = RESPONSE;
+            resp->id = info.id;
+            resp->len = len;
+            resp->waitNs = info.waitNs;
+
+            assert(curNs > info.startNs);
+            resp->svcNs = curNs - info.startNs;
+        }
+
+        // Counts n more finished requests, and tells whether they include
+        // the last warmup request and the last request of the run
+        void countFinished(uint64_t n, bool* roiBegins, bool* roiEnds) {
+            uint64_t finished = (finishedReqs += n);
+            if (steady) {
+                steady->poll(finished, roiBegins, roiEnds);
+            } else {
+                uint64_t prev = finished - n;
+                *roiBegins = (prev < warmupReqs && finished >= warmupReqs);
+                *roiEnds = maxReqs && (prev < warmupReqs + maxReqs) && 
+                    (finished >= warmupReqs + maxReqs);
+            }
+
+            if (perf && *roiBegins) perf->setActive(true);
+            if (perf && *roiEnds) {
+                perf->setActive(false);
+                writePerf();
+            }
+        }
+
+        // Per-request event counts, if TBENCH_PERF_COUNTERS is set
+        PerfCounters* perf;
+
+        // Decides when the ROI begins and ends, if TBENCH_AUTO_WARMUP or
+        // TBENCH_ROI_CI_PCT is set; otherwise request counts do
+        SteadyState* steady;
+
+        // Feeds a response's latency in the server to steady, if enabled
+        void recordLatency(int id, const Response* resp) {
+            if (steady) steady->record(id, resp->waitNs + resp->svcNs);
+        }
 
     public:
-        Server(int nthreads) {
+        Server(int nthreads) 
+            : asyncInfo(MAX_ASYNC_REQS)
+            , asyncFree(MAX_ASYNC_REQS)
+        {
+            for (uint64_t h = 0; h < MAX_ASYNC_REQS; ++h) asyncFree.push(h);
+            asyncWaiters = 0;
+            sem_init(&asyncFreed, 0, 0);
+
             finishedReqs = 0;
             maxReqs = getOpt("TBENCH_MAXREQS", 0);
             warmupReqs = getOpt("TBENCH_WARMUPREQS", 0);
             reqInfo.resize(nthreads);
+            Clock::get(); // Calibrate before the first request is stamped
+
+            steady = SteadyState::enabled() ? 
+                new SteadyState(nthreads, warmupReqs, maxReqs) : nullptr;
+
+            perf = nullptr;
+            if (getOpt<int>("TBENCH_PERF_COUNTERS", 0)) {
+                perf = new PerfCounters(getOpt<std::string>(
+                            "TBENCH_PERF_EVENTS", "cycles,instructions," \
+                            "cache-misses,branch-misses,dTLB-load-misses," \
+                            "context-switches"), nthreads);
+                if (perf->numEvents() == 0) {
+                    std::cerr << "WARNING: No perf events can be counted, " \
+                        << "disabling perf counters" << std::endl;
+                    delete perf;
+                    perf = nullptr;
+                } else {
+                    perf->setActive(warmupReqs == 0);
+                }
+            }
+        }
+
+        // Called by each app thread before it takes requests
+        void threadStart(int id) {
+            if (perf) perf->threadStart(id);
+        }
+
+        // Writes the per-request event counts so far to server_perf.csv
+        void writePerf() {
+            if (perf) perf->write("server_perf.csv");
         }
 
-        virtual size_t recvReq(int id, void** data) = 0;
-        virtual void sendResp(int id, const void* data, size_t size) = 0;
+        // See tBenchRecvReqBatch() and tBenchSendRespBatch()
+        virtual size_t recvReqBatch(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t maxWaitNs) = 0;
+        virtual void sendRespBatch(int id, const uint64_t* handles,
+                const void* const* data, const size_t* lens, size_t n) = 0;
+
+        // The single-request API is a batch of one
+        size_t recvReq(int id, void** data) {
+            size_t len;
+            uint64_t handle;
+            recvReqBatch(id, data, &len, &handle, 1, 0);
+            return len;
+        }
+
+        void sendResp(int id, const void* data, size_t len) {
+            uint64_t handle = 0;
+            sendRespBatch(id, &handle, &data, &len, 1);
+        }
+
+        // See tBenchRecvReqAsync() and tBenchSendRespAsync(). Service time
+        // runs from when a request is taken to when it is answered. A
+        // request's stats land in the per-thread slots of the thread that
+        // took it (id), whichever thread answers it, since repliers need not
+        // be server threads at all; per-request perf counters are not kept,
+        // since a thread's events cannot be split among overlapping requests.
+        virtual size_t recvReqAsync(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t timeoutNs) = 0;
+        virtual void sendRespAsync(uint64_t handle, const void* data,
+                size_t len) = 0;
+
+        // See tBenchServeAsync()
+        void serveAsync(int id, tBenchReqHandler handler, void* arg) {
+            const size_t MAX_TAKEN = 32;
+            void* data[MAX_TAKEN];
+            size_t lens[MAX_TAKEN];
+            uint64_t handles[MAX_TAKEN];
+            while (true) {
+                size_t n = recvReqAsync(id, data, lens, handles, MAX_TAKEN,
+                        UINT64_MAX);
+                for (size_t i = 0; i < n; ++i) {
+                    handler(handles[i], data[i], lens[i], arg);
+                }
+                // All handles are taken; wait for the app to answer some
+                if (n == 0) waitAsyncFree();
+            }
+        }
 };
 
 class IntegratedServer : public Server, public Client {
+    private:
+        // Request each thread generated but left out of its last batch,
+        // because it arrives after the batch closed
+        std::vector<Request*> heldReqs;
+
+        // Counts n answered requests, starting or ending the ROI with them
+        void finishReqs(uint64_t n);
+
     public:
         IntegratedServer(int nthreads);
 
-        size_t recvReq(int id, void** data);
-        void sendResp(int id, const void* data, size_t size);
+        size_t recvReqBatch(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t maxWaitNs);
+        void sendRespBatch(int id, const uint64_t* handles,
+                const void* const* data, const size_t* lens, size_t n);
+
+        size_t recvReqAsync(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t timeoutNs);
+        void sendRespAsync(uint64_t handle, const void* data, size_t len);
 };
 
-class NetworkedServer : public Server {
+// How the queue in front of app threads orders requests. CLASS_PRIORITY serves
+// the highest-priority class first, EDF the request whose deadline (its own,
+// or else arrival plus a per-class budget) is earliest, and SJF the request
+// whose class has the shortest service time so far.
+enum QueuePolicy { FCFS, CLASS_PRIORITY, EDF, SJF };
+
+// Reads per-class values from a comma-separated list in env var name, with
+// classes past the end of the list taking its last value. Returns false if the
+// variable is unset.
+static bool getClassOpts(const char* name, uint64_t* vals) {
+    std::string spec = getOpt<std::string>(name, "");
+    if (spec.empty()) return false;
+
+    std::stringstream ss(spec);
+    std::string item;
+    int c = 0;
+    while (c < TBENCH_MAX_REQ_CLASSES && std::getline(ss, item, ',')) {
+        std::stringstream is(item);
+        if (!(is >> vals[c])) {
+            std::cerr << "Invalid " << name << " entry '" << item << "'" \
+                << std::endl;
+            exit(-1);
+        }
+        ++c;
+    }
+
+    if (c == 0) {
+        std::cerr << "Invalid " << name << " '" << spec << "'" << std::endl;
+        exit(-1);
+    }
+    for (; c < TBENCH_MAX_REQ_CLASSES; ++c) vals[c] = vals[c - 1];
+    return true;
+}
+
+// Server side of the backends whose clients run in separate processes.
+// Transport threads decode incoming requests into pooled buffers and queue
+// them; app threads take them off the queue in recvReqBatch(), and
+// sendRespBatch() answers on the connection each request came in on.
+class QueuedServer : public Server {
+    protected:
+        // Most responses coalesced into one sendMsg() call
+        static const int SEND_GROUP = 32;
+
+        struct QueuedReq {
+            Request* req; // Header + payload only, from bufPool
+            int conn;
+            uint64_t enqNs; // When it joined reqQueue
+            uint64_t deadlineNs; // UINT64_MAX if none
+        };
+
+        BufPool bufPool; // Request buffers and unsent response remainders
+        QueuePolicy policy;
+        ReqQueue<QueuedReq> reqQueue;
+        sem_t reqsAvail; // Number of requests in reqQueue
+
+        uint64_t classPrios[TBENCH_MAX_REQ_CLASSES]; // Lowest runs first
+        uint64_t classBudgetNs[TBENCH_MAX_REQ_CLASSES]; // EDF deadlines
+        std::atomic<uint64_t> svcEstNs[TBENCH_MAX_REQ_CLASSES]; // SJF
+
+        // Load shedding: requests past their deadline, and requests that
+        // arrive to a queue this long (0 = unbounded), are answered with SHED
+        // instead of being served
+        bool shedExpired;
+        int shedQueueLen;
+
+        static QueuePolicy getPolicy() {
+            std::string name = getOpt<std::string>("TBENCH_SCHED_POLICY",
+                    "fcfs");
+            if (name == "fcfs") return FCFS;
+            if (name == "priority") return CLASS_PRIORITY;
+            if (name == "edf") return EDF;
+            if (name == "sjf") return SJF;
+            std::cerr << "Unknown TBENCH_SCHED_POLICY " << name << std::endl;
+            exit(-1);
+        }
+
+        static unsigned classOf(const Request* req) {
+            return std::min<unsigned>(req->cls, TBENCH_MAX_REQ_CLASSES - 1);
+        }
+
+        // Position of a request in reqQueue, lowest first
+        uint64_t queueKey(const QueuedReq& qreq) {
+            const Request* req = qreq.req;
+            switch (policy) {
+                case CLASS_PRIORITY:
+                    return classPrios[classOf(req)];
+                case EDF:
+                    return (qreq.deadlineNs != UINT64_MAX) ? qreq.deadlineNs :
+                        qreq.enqNs + classBudgetNs[classOf(req)];
+                case SJF:
+                    return svcEstNs[classOf(req)];
+                default:
+                    return 0;
+            }
+        }
+
+        // Requests being served by each worker thread, indexed by handle
+        std::vector<std::vector<QueuedReq>> activeReqs;
+
+        // Requests taken through the asynchronous API, indexed by handle
+        std::vector<QueuedReq> asyncReqs;
+
+        // Live telemetry of service times, if enabled. Queue depth is read
+        // off reqsAvail
+        Telemetry* telemetry;
+        std::vector<Telemetry::Slot*> telemetrySlots; // One per worker
+        std::atomic_int inService;
+
+        void enqueueReq(Request* req, int conn) {
+            uint64_t curNs = getCurNs();
+            uint64_t deadlineNs = (req->budgetNs == NO_DEADLINE) ? UINT64_MAX :
+                curNs + req->budgetNs;
+            QueuedReq qreq = { req, conn, curNs, deadlineNs };
+
+            if (shedExpired && curNs >= deadlineNs) {
+                shedReq(qreq);
+                return;
+            }
+            if (shedQueueLen) {
+                int queued;
+                sem_getvalue(&reqsAvail, &queued);
+                if (queued >= shedQueueLen) {
+                    shedReq(qreq);
+                    return;
+                }
+            }
+
+            uint64_t key = queueKey(qreq);
+            while (!reqQueue.push(qreq, key)) {
+                sched_yield(); // Workers are backed up
+            }
+            sem_post(&reqsAvail);
+        }
+
+        // Answers a request with SHED right away, and frees it. Shed requests
+        // do not count toward warmup or the ROI, which would otherwise end
+        // early under overload, just when shedding kicks in; clients count
+        // them separately.
+        void shedReq(const QueuedReq& qreq) {
+            alignas(Response) char hdr[RESP_HDR_BYTES];
+            Response* resp = reinterpret_cast<Response*>(hdr);
+            resp->type = SHED;
+            resp->id = qreq.req->id;
+            resp->svcNs = 0;
+            resp->waitNs = getCurNs() - qreq.enqNs;
+            resp->len = 0;
+
+            struct iovec iov = { hdr, RESP_HDR_BYTES };
+            sendMsg(qreq.conn, &iov, 1);
+
+            bufPool.release(reinterpret_cast<char*>(qreq.req));
+        }
+
+        // Takes a request off the queue and adds it to batch, unless it has
+        // expired meanwhile
+        void takeReq(std::vector<QueuedReq>& batch) {
+            QueuedReq qreq = dequeueReq();
+            if (shedExpired && getCurNs() >= qreq.deadlineNs) {
+                shedReq(qreq);
+            } else {
+                batch.push_back(qreq);
+            }
+        }
+
+        // Updates the stats that follow service times with a response to
+        // qreq, answered by thread id
+        void noteResp(int id, const QueuedReq& qreq, const Response* resp) {
+            recordLatency(id, resp);
+
+            if (telemetry) {
+                Telemetry::record(telemetrySlots[id], resp->svcNs);
+                --inService;
+            }
+
+            // Moving average over the last several requests of the class.
+            // Threads may race on it; an estimate is all SJF needs
+            if (policy == SJF) {
+                std::atomic<uint64_t>& est = svcEstNs[classOf(qreq.req)];
+                est = est - est / 8 + resp->svcNs / 8;
+            }
+        }
+
+        // Takes a request off the queue once reqsAvail has been decremented
+        // for it
+        QueuedReq dequeueReq() {
+            // The semaphore guarantees an item, but a producer that claimed
+            // an earlier cell may still be publishing it
+            QueuedReq qreq;
+            while (!reqQueue.pop(&qreq)) sched_yield();
+            return qreq;
+        }
+
+        // Waits on reqsAvail until deadlineNs (0 = forever). Returns false on
+        // timeout.
+        bool waitReq(uint64_t deadlineNs) {
+            while (true) {
+                int res;
+                if (!deadlineNs) {
+                    res = sem_wait(&reqsAvail);
+                } else {
+                    uint64_t curNs = getCurNs();
+                    if (curNs >= deadlineNs) return false;
+
+                    // sem_timedwait() only takes wall-clock deadlines
+                    struct timespec ts;
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    uint64_t wallNs = ts.tv_sec * 1000000000ULL + ts.tv_nsec +
+                        (deadlineNs - curNs);
+                    ts.tv_sec = wallNs / 1000000000ULL;
+                    ts.tv_nsec = wallNs % 1000000000ULL;
+                    res = sem_timedwait(&reqsAvail, &ts);
+                }
+
+                if (res == 0) return true;
+                if (errno == ETIMEDOUT) continue; // Recheck against our clock
+                if (errno != EINTR) {
+                    std::cerr << "sem_wait() failed: " << strerror(errno) \
+                        << std::endl;
+                    exit(-1);
+                }
+            }
+        }
+
+        // Sends the grouped responses, all of which go to conn
+        void sendGroup(int conn, struct iovec* iov, int nresps) {
+            sendMsg(conn, iov, 2 * nresps);
+
+            // Counted after the responses are sent, so every response counted
+            // before the ROI_BEGIN/FINISH marker precedes it on its connection
+            bool roiBegins, roiEnds;
+            countFinished(nresps, &roiBegins, &roiEnds);
+            if (roiBegins) broadcast(ROI_BEGIN);
+            if (roiEnds) broadcast(FINISH);
+        }
+
+        // Sends a message made of iovcnt pieces to the client on conn. The
+        // caller may reuse the pieces once this returns.
+        virtual void sendMsg(int conn, const struct iovec* iov, 
+                int iovcnt) = 0;
+        virtual int numConns() const = 0;
+
+        void broadcast(ResponseType type) {
+            alignas(Response) char hdr[RESP_HDR_BYTES];
+            memset(hdr, 0, RESP_HDR_BYTES);
+            reinterpret_cast<Response*>(hdr)->type = type;
+
+            struct iovec iov = { hdr, RESP_HDR_BYTES };
+            for (int c = 0; c < numConns(); ++c) sendMsg(c, &iov, 1);
+        }
+
+    public:
+        QueuedServer(int nthreads) 
+            : Server(nthreads)
+            , policy(getPolicy())
+            , reqQueue(getOpt<size_t>("TBENCH_SERVER_QUEUE_LEN", 1 << 16),
+                    policy != FCFS)
+        {
+            sem_init(&reqsAvail, 0, 0);
+
+            for (int c = 0; c < TBENCH_MAX_REQ_CLASSES; ++c) {
+                classPrios[c] = c;
+                svcEstNs[c] = 0;
+            }
+            getClassOpts("TBENCH_SCHED_PRIOS", classPrios);
+            if (getClassOpts("TBENCH_SCHED_DEADLINES_US", classBudgetNs)) {
+                for (uint64_t& budget : classBudgetNs) budget *= 1000;
+            } else {
+                std::fill(classBudgetNs, 
+                        classBudgetNs + TBENCH_MAX_REQ_CLASSES, 0);
+            }
+
+            shedExpired = getOpt<int>("TBENCH_SHED_EXPIRED", 0);
+            shedQueueLen = getOpt<int>("TBENCH_SHED_QUEUE_LEN", 0);
+
+            activeReqs.resize(nthreads);
+            asyncReqs.resize(MAX_ASYNC_REQS);
+
+            inService = 0;
+            telemetry = nullptr;
+            uint64_t telemetryMs = getOpt<uint64_t>("TBENCH_TELEMETRY_MS", 0);
+            if (telemetryMs) {
+                telemetry = new Telemetry("server_telemetry.csv", 
+                        telemetryMs * 1000 * 1000, ",queue_depth,in_service",
+                        [this](std::ostream& out) {
+                            int queued;
+                            sem_getvalue(&reqsAvail, &queued);
+                            out << "," << queued << "," << inService;
+                        });
+                for (int i = 0; i < nthreads; ++i) {
+                    telemetrySlots.push_back(telemetry->newSlot());
+                }
+            }
+        }
+
+        size_t recvReqBatch(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t maxWaitNs) {
+            // Apps may use the previous batch's data until now
+            std::vector<QueuedReq>& batch = activeReqs[id];
+            for (QueuedReq& qreq : batch) {
+                bufPool.release(reinterpret_cast<char*>(qreq.req));
+            }
+            batch.clear();
+
+            while (batch.empty()) {
+                waitReq(0);
+                takeReq(batch);
+            }
+
+            uint64_t deadlineNs = maxWaitNs ? getCurNs() + maxWaitNs : 0;
+            while (batch.size() < maxReqs) {
+                if (sem_trywait(&reqsAvail) != 0 && 
+                        (!deadlineNs || !waitReq(deadlineNs))) {
+                    break;
+                }
+                takeReq(batch);
+            }
+
+            if (telemetry) inService += batch.size();
+
+            // Service starts for the whole batch when the app gets it
+            uint64_t curNs = getCurNs();
+            std::vector<ReqInfo>& info = reqInfo[id];
+            info.resize(batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                info[i].id = batch[i].req->id;
+                info[i].startNs = curNs;
+                info[i].waitNs = curNs - batch[i].enqNs;
+
+                data[i] = reinterpret_cast<void*>(&batch[i].req->data);
+                lens[i] = batch[i].req->len;
+                handles[i] = i;
+            }
+
+            if (perf) perf->start(id);
+            return batch.size();
+        }
+
+        // Consecutive responses to the same connection go out in one message
+        void sendRespBatch(int id, const uint64_t* handles,
+                const void* const* data, const size_t* lens, size_t n) {
+            alignas(Response) char hdrs[SEND_GROUP][RESP_HDR_BYTES];
+            struct iovec iov[2 * SEND_GROUP];
+            int grouped = 0;
+            int groupConn = -1;
+            size_t groupBytes = 0;
+
+            uint64_t curNs = getCurNs();
+            if (perf) perf->stop(id, n);
+            for (size_t i = 0; i < n; ++i) {
+                ReqInfo& info = getReqInfo(id, handles[i]);
+                const QueuedReq& qreq = activeReqs[id][handles[i]];
+                int conn = qreq.conn;
+
+                // Groups are kept within one maximum-sized message, which
+                // every transport can take in one piece
+                size_t bytes = RESP_HDR_BYTES + lens[i];
+                if (grouped && (conn != groupConn || grouped == SEND_GROUP ||
+                            groupBytes + bytes > 
+                            RESP_HDR_BYTES + MAX_RESP_BYTES)) {
+                    sendGroup(groupConn, iov, grouped);
+                    grouped = 0;
+                    groupBytes = 0;
+                }
+
+                Response* resp = reinterpret_cast<Response*>(hdrs[grouped]);
+                fillResp(resp, info, lens[i], curNs);
+                if (perf) perf->record(id, resp->svcNs);
+                noteResp(id, qreq, resp);
+
+                // The app's payload goes out as-is, right behind the header
+                iov[2 * grouped].iov_base = resp;
+                iov[2 * grouped].iov_len = RESP_HDR_BYTES;
+                iov[2 * grouped + 1].iov_base = const_cast<void*>(data[i]);
+                iov[2 * grouped + 1].iov_len = lens[i];
+
+                ++grouped;
+                groupConn = conn;
+                groupBytes += bytes;
+            }
+
+            if (grouped) sendGroup(groupConn, iov, grouped);
+        }
+
+        // Takes requests one at a time, each with a handle of its own, and
+        // waits only for the first
+        size_t recvReqAsync(int id, void** data, size_t* lens,
+                uint64_t* handles, size_t maxReqs, uint64_t timeoutNs) {
+            // waitReq() takes 0 to mean no deadline
+            uint64_t deadlineNs = (timeoutNs == UINT64_MAX) ? 0 :
+                getCurNs() + std::max<uint64_t>(timeoutNs, 1);
+
+            size_t n = 0;
+            uint64_t handle;
+            while (n < maxReqs && allocAsync(&handle)) {
+                if (sem_trywait(&reqsAvail) != 0 && 
+                        (n || !waitReq(deadlineNs))) {
+                    freeAsync(handle);
+                    break;
+                }
+
+                QueuedReq qreq = dequeueReq();
+                uint64_t curNs = getCurNs();
+                if (shedExpired && curNs >= qreq.deadlineNs) {
+                    shedReq(qreq);
+                    freeAsync(handle);
+                    continue;
+                }
+
+                asyncReqs[handle] = qreq;
+                ReqInfo& info = asyncInfo[handle];
+                info.id = qreq.req->id;
+                info.startNs = curNs;
+                info.waitNs = curNs - qreq.enqNs;
+                info.tid = id;
+                if (telemetry) ++inService;
+
+                data[n] = reinterpret_cast<void*>(&qreq.req->data);
+                lens[n] = qreq.req->len;
+                handles[n] = handle;
+                ++n;
+            }
+
+            return n;
+        }
+
+        void sendRespAsync(uint64_t handle, const void* data, size_t len) {
+            alignas(Response) char hdr[RESP_HDR_BYTES];
+            Response* resp = reinterpret_cast<Response*>(hdr);
+            const ReqInfo& info = getAsyncInfo(handle);
+            fillResp(resp, info, len, getCurNs());
+
+            // Freed only after sending, since data may point into it
+            QueuedReq qreq = asyncReqs[handle];
+            noteResp(info.tid, qreq, resp);
+
+            struct iovec iov[2] = { { hdr, RESP_HDR_BYTES },
+                { const_cast<void*>(data), len } };
+            sendGroup(qreq.conn, iov, 1);
+
+            bufPool.release(reinterpret_cast<char*>(qreq.req));
+            freeAsync(handle);
+        }
+};
+
+class NetworkedServer : public QueuedServer {
     private:
-        pthread_mutex_t sendLock;
-        pthread_mutex_t recvLock;
+        // A connection to one client. Requests on it are decoded by the I/O
+        // thread that owns it; responses are written by whichever worker
+        // produced them, falling back to the owner (via EPOLLOUT) when the
+        // socket buffer is full. sendLock is per connection, so workers only
+        // contend when replying to the same client.
+        struct Conn {
+            int idx; // In conns
+            int fd;
+            int epfd; // Owning I/O thread's epoll instance
+            bool closed;
 
-        Request *reqbuf; // One for each server thread
+            // Receive state, only touched by the owning I/O thread
+            char* rbuf;
+            size_t rlen;
+            Request* partial; // Request too large for rbuf, being filled in
+            size_t partialGot;
 
-        std::vector<int> clientFds;
-        std::vector<int> activeFds; // Currently active client fds for 
-                                    // each thread
-        size_t recvClientHead; // The idx of the client at the 'head' of the 
-                               // receive queue. We start with this idx and go
-                               // down the list of eligible fds to receive from.
-                               // This is incremented by 1 on each go. This
-                               // avoids unfairly favoring some clients over
-                               // others
+            // Send state
+            struct OutMsg {
+                char* buf;
+                size_t len;
+                size_t off;
+            };
+            pthread_mutex_t sendLock;
+            std::deque<OutMsg> sendQueue;
+            bool waitingOut; // Registered for EPOLLOUT
 
-        void printDebugStats() const;
+            Conn(int idx, int fd, int epfd);
+        };
+
+        struct IoThread {
+            NetworkedServer* server;
+            pthread_t thread;
+            int epfd;
+        };
+
+        std::vector<Conn*> conns;
+        std::vector<IoThread> ioThreads;
+        std::atomic_int liveConns;
+
+        static void* ioThreadMain(void* ptr);
+        void ioLoop(IoThread* io);
 
         // Helper Functions
-        void removeClient(int fd);
-        bool checkRecv(int recvd, int expected, int fd);
+        bool readConn(Conn* conn);
+        void closeConn(Conn* conn);
+        void sendMsg(int conn, const struct iovec* iov, int iovcnt);
+        int numConns() const { return conns.size(); }
+        bool flushConn(Conn* conn);
     public:
         NetworkedServer(int nthreads, std::string ip, int port, int nclients);
-        ~NetworkedServer();
 
-        size_t recvReq(int id, void** data);
-        void sendResp(int id, const void* data, size_t size);
+        void finish();
+};
+
+// Serves clients on the same host through a shared-memory segment (see
+// shm.h) instead of sockets. A poller thread drains the request rings into the
+// request queue, and workers write responses straight into the response rings.
+class ShmServer : public QueuedServer {
+    private:
+        struct Conn {
+            ShmChannel* chan;
+            bool closed; // Client process is gone
+            pthread_mutex_t sendLock; // Serializes workers on the resp ring
+        };
+
+        ShmHeader* shm;
+        std::vector<Conn*> conns;
+        int liveConns; // Only touched by the poller
+        uint64_t spinNs; // How long waiters poll before sleeping
+
+        pthread_t poller;
+        static void* pollerMain(void* ptr);
+        void pollLoop();
+        bool readReq(Conn* conn, int idx);
+        void checkClients();
+
+        void sendMsg(int conn, const struct iovec* iov, int iovcnt);
+        int numConns() const { return conns.size(); }
+    public:
+        ShmServer(int nthreads, std::string name, int nclients);
+
         void finish();
 };
 
@@ -0,0 +1,263 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include "helpers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+
+// Layout of the shared-memory segment that connects a server to its clients
+// when both run on the same host. The segment has one channel per client
+// connection, each a pair of rings: requests flow client -> server and
+// responses server -> client. Everything in the segment is addressed by offset,
+// since each process maps it at a different address.
+
+static const uint64_t SHM_MAGIC = 0x7462656e63687368ULL; // "tbenchsh"
+
+// Lets a consumer sleep until a producer has published something. Producers pay
+// one atomic add per message, and a futex syscall only when a consumer is
+// actually asleep.
+struct ShmDoorbell {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> sleepers;
+
+    void ring() {
+        seq.fetch_add(1);
+        if (sleepers.load()) {
+            syscall(SYS_futex, &seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    // Returns once ready() holds, or after roughly timeoutNs (0 = never). Polls
+    // for up to spinNs before going to sleep.
+    template<typename F>
+    bool wait(F ready, uint64_t spinNs, uint64_t timeoutNs) {
+        if (ready()) return true;
+
+        uint64_t startNs = getCurNs();
+        while (getCurNs() - startNs < spinNs) {
+            if (ready()) return true;
+#if defined(__x86_64__) || defined(__i386__)
+            asm volatile("pause");
+#endif
+        }
+
+        // Futex waits also end on signals and spurious wakeups, so keep
+        // waiting until ready() holds or the time is up
+        uint64_t sleepNs = getCurNs();
+        sleepers.fetch_add(1);
+        while (true) {
+            // A publish after this load changes seq, so the futex wait below
+            // returns at once instead of missing it
+            uint32_t cur = seq.load();
+            if (ready()) break;
+
+            uint64_t leftNs = 0;
+            if (timeoutNs) {
+                uint64_t waitedNs = getCurNs() - sleepNs;
+                if (waitedNs >= timeoutNs) break;
+                leftNs = timeoutNs - waitedNs;
+            }
+
+            struct timespec ts = { (time_t)(leftNs / (1000*1000*1000)),
+                (long)(leftNs % (1000*1000*1000)) };
+            syscall(SYS_futex, &seq, FUTEX_WAIT, cur,
+                    timeoutNs ? &ts : nullptr, nullptr, 0);
+        }
+        sleepers.fetch_sub(1);
+
+        return ready();
+    }
+};
+
+// Single-producer, single-consumer ring of variable-length messages. The
+// producer advances tail only once a whole message is in, so the consumer
+// never sees part of one, and a nonempty ring always holds a full message.
+struct ShmRing {
+    alignas(64) std::atomic<uint64_t> head; // Consumer's position
+    alignas(64) std::atomic<uint64_t> tail; // Producer's position
+    alignas(64) uint64_t size;              // Power of 2
+    uint64_t dataOff;                       // Data offset in the segment
+
+    bool empty() const { return head.load() == tail.load(); }
+
+    size_t space() const {
+        return size - (tail.load(std::memory_order_relaxed) -
+                head.load(std::memory_order_acquire));
+    }
+
+    // Producer only; the caller has checked space()
+    void write(char* base, const struct iovec* iov, int iovcnt) {
+        char* data = base + dataOff;
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        for (int i = 0; i < iovcnt; ++i) {
+            const char* src = reinterpret_cast<const char*>(iov[i].iov_base);
+            size_t len = iov[i].iov_len;
+            while (len) {
+                size_t off = pos & (size - 1);
+                size_t chunk = std::min(len, size - off);
+                memcpy(data + off, src, chunk);
+                src += chunk;
+                pos += chunk;
+                len -= chunk;
+            }
+        }
+        tail.store(pos, std::memory_order_release);
+    }
+
+    // Consumer only: copies len bytes starting off bytes past head
+    void peek(char* base, size_t off, char* dst, size_t len) const {
+        const char* data = base + dataOff;
+        uint64_t pos = head.load(std::memory_order_relaxed) + off;
+        while (len) {
+            size_t o = pos & (size - 1);
+            size_t chunk = std::min(len, size - o);
+            memcpy(dst, data + o, chunk);
+            dst += chunk;
+            pos += chunk;
+            len -= chunk;
+        }
+    }
+
+    // Consumer only: frees the first len bytes
+    void consume(size_t len) {
+        head.store(head.load(std::memory_order_relaxed) + len,
+                std::memory_order_release);
+    }
+};
+
+struct ShmChannel {
+    std::atomic<int32_t> clientPid; // Set once a client has claimed it
+    ShmDoorbell respBell;           // Rung by the server after each response
+    ShmRing reqs;
+    ShmRing resps;
+};
+
+struct alignas(64) ShmHeader {
+    std::atomic<uint64_t> magic; // Set last, once the server is done
+    uint32_t nchannels;
+    std::atomic<uint32_t> claimed; // Channels handed out to clients
+    int32_t serverPid;             // So clients can tell if it died
+    ShmDoorbell reqBell;           // Rung by clients after each request
+    // nchannels ShmChannels follow, then the ring data
+
+    ShmChannel* channel(int c) {
+        return reinterpret_cast<ShmChannel*>(this + 1) + c;
+    }
+};
+
+// How long a waiter on either side polls before sleeping on its doorbell.
+// Polling only pays off if the other side has a core of its own.
+inline uint64_t shmSpinNs() {
+    uint64_t defUs = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? 50 : 0;
+    return getOpt<uint64_t>("TBENCH_SHM_SPIN_US", defUs) * 1000;
+}
+
+inline void* shmMap(int fd, size_t len) {
+    void* base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << "mmap() failed: " << strerror(errno) << std::endl;
+        exit(-1);
+    }
+    return base;
+}
+
+// Creates the segment for nchannels channels with rings of at least
+// ringBytes, replacing any stale segment of the same name
+inline ShmHeader* shmCreate(const std::string& name, int nchannels,
+        size_t ringBytes) {
+    uint64_t size = 4096;
+    while (size < ringBytes) size <<= 1;
+
+    size_t dataOff = sizeof(ShmHeader) + nchannels * sizeof(ShmChannel);
+    dataOff = (dataOff + 4095) & ~static_cast<size_t>(4095);
+    size_t len = dataOff + 2 * nchannels * size;
+
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1 || ftruncate(fd, len) == -1) {
+        std::cerr << "Could not create shared memory segment " << name \
+            << ": " << strerror(errno) << std::endl;
+        exit(-1);
+    }
+
+    // The segment starts out zeroed, which is a valid initial state for
+    // every field not set here
+    ShmHeader* hdr = reinterpret_cast<ShmHeader*>(shmMap(fd, len));
+    close(fd);
+
+    hdr->nchannels = nchannels;
+    hdr->serverPid = getpid();
+    for (int c = 0; c < nchannels; ++c) {
+        ShmChannel* chan = hdr->channel(c);
+        chan->reqs.size = size;
+        chan->reqs.dataOff = dataOff + 2 * c * size;
+        chan->resps.size = size;
+        chan->resps.dataOff = dataOff + (2 * c + 1) * size;
+    }
+    hdr->magic = SHM_MAGIC;
+
+    return hdr;
+}
+
+// Maps an existing segment, waiting up to timeoutS for the server to create it
+inline ShmHeader* shmAttach(const std::string& name, int timeoutS) {
+    for (int t = 0; t < timeoutS * 100; ++t) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1) {
+            usleep(10 * 1000);
+            continue;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            close(fd);
+            usleep(10 * 1000);
+            continue;
+        }
+
+        ShmHeader* hdr = reinterpret_cast<ShmHeader*>(shmMap(fd, st.st_size));
+        close(fd);
+
+        while (hdr->magic.load() != SHM_MAGIC) usleep(1000);
+        return hdr;
+    }
+
+    std::cerr << "Could not attach to shared memory segment " << name \
+        << ": " << strerror(errno) << std::endl;
+    exit(-1);
+}
+
+#endif
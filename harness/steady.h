@@ -0,0 +1,250 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __STEADY_H
+#define __STEADY_H
+
+#include "helpers.h"
+#include "hist.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+// Decides when the ROI begins and ends from the latencies the server sees,
+// instead of from fixed request counts. Latencies are grouped in windows of
+// windowNs. With autoWarmup, the ROI begins once the last few windows agree on
+// throughput and median latency to within a tolerance (or warmup runs out of
+// time); otherwise after warmupReqs, as usual. With ciPct, the ROI ends once
+// the 95% confidence interval of the target percentile is within ciPct of its
+// estimate; maxReqs still caps its length.
+class SteadyState {
+    private:
+        struct Slot {
+            pthread_mutex_t lock;
+            Histogram lats;
+
+            Slot() { pthread_mutex_init(&lock, nullptr); }
+        };
+
+        struct Window {
+            double qps;
+            uint64_t p50;
+        };
+
+        // Options
+        bool autoWarmup;
+        uint64_t windowNs;
+        size_t stableWindows; // That must agree to end warmup
+        double tol; // Relative spread allowed among them
+        uint64_t maxWarmupNs;
+        uint64_t warmupReqs; // Least warmup; the only criterion if !autoWarmup
+        uint64_t maxReqs;
+        double ciPct; // 0 = ROI ends after maxReqs only
+        double ciPctile;
+
+        std::vector<Slot*> slots; // One per app thread
+
+        // Window bookkeeping, under lock
+        pthread_mutex_t lock;
+        std::atomic<uint64_t> windowEndNs; // 0 until the first request
+        uint64_t windowStartNs;
+        uint64_t startNs;
+        Histogram* window;
+        Histogram* roiLats; // Windows that started in the ROI
+        std::deque<Window> recent;
+
+        std::atomic<uint64_t> roiFirstReq; // UINT64_MAX before the ROI
+        std::atomic<uint64_t> roiStartNs;
+        std::atomic<bool> ended;
+
+        // Spread of the recent windows' f, relative to their mean
+        template<typename F>
+        double spread(F f) const {
+            double lo = f(recent.front()), hi = lo, sum = 0.0;
+            for (const Window& w : recent) {
+                lo = std::min(lo, f(w));
+                hi = std::max(hi, f(w));
+                sum += f(w);
+            }
+            double mean = sum / recent.size();
+            return mean ? (hi - lo) / mean : 0.0;
+        }
+
+        bool isStable() const {
+            if (recent.size() < stableWindows) return false;
+            return spread([](const Window& w) { return w.qps; }) <= tol &&
+                spread([](const Window& w) { return (double)w.p50; }) <= tol;
+        }
+
+        // Distribution-free 95% CI of the ciPctile-th percentile, from the
+        // ranks the binomial puts around it. Returns false until enough
+        // samples lie beyond the percentile for the bounds to mean anything.
+        bool tailInterval(uint64_t* est, uint64_t* lo, uint64_t* hi) const {
+            double n = roiLats->count();
+            double q = ciPctile / 100.0;
+            if (n * (1.0 - q) < 10.0) return false;
+
+            double halfRanks = 1.96 * sqrt(n * q * (1.0 - q));
+            *est = roiLats->percentile(ciPctile);
+            *lo = roiLats->percentile(std::max(0.0, n*q - halfRanks) / n * 100);
+            *hi = roiLats->percentile(std::min(n, n*q + halfRanks) / n * 100);
+            return true;
+        }
+
+        void closeWindow(uint64_t curNs, uint64_t finished, bool* roiBegins,
+                bool* roiEnds) {
+            window->reset();
+            for (Slot* slot : slots) {
+                pthread_mutex_lock(&slot->lock);
+                window->merge(slot->lats);
+                slot->lats.reset();
+                pthread_mutex_unlock(&slot->lock);
+            }
+
+            Window w = { window->count() * 1e9 / (curNs - windowStartNs),
+                window->percentile(50.0) };
+            recent.push_back(w);
+            if (recent.size() > stableWindows) recent.pop_front();
+
+            if (roiFirstReq == UINT64_MAX) {
+                // Without autoWarmup, poll() starts the ROI
+                if (!autoWarmup || finished < warmupReqs) return;
+                bool timeUp = curNs - startNs >= maxWarmupNs;
+                if (!isStable() && !timeUp) return;
+
+                roiStartNs = curNs;
+                roiFirstReq = finished;
+                *roiBegins = true;
+                std::cerr << (timeUp ? "Warmup did not stabilize; starting " \
+                        "ROI anyway" : "Steady state reached") << " after " \
+                    << (curNs - startNs) / 1e9 << " s and " << finished \
+                    << " requests (" << w.qps << " QPS, median latency " \
+                    << w.p50 << " ns)" << std::endl;
+                return;
+            }
+
+            if (windowStartNs < roiStartNs) return; // Partly warmup
+            roiLats->merge(*window);
+            uint64_t est, lo, hi;
+            if (ciPct && tailInterval(&est, &lo, &hi) &&
+                    std::max(est - lo, hi - est) <= est * ciPct / 100.0 &&
+                    !ended.exchange(true)) {
+                *roiEnds = true;
+                std::cerr << "Latency p" << ciPctile << " of " << est \
+                    << " ns known to [" << lo << ", " << hi << "] after " \
+                    << roiLats->count() << " ROI requests, ending run" \
+                    << std::endl;
+            }
+        }
+
+    public:
+        SteadyState(int nthreads, uint64_t warmupReqs, uint64_t maxReqs)
+            : warmupReqs(warmupReqs)
+            , maxReqs(maxReqs)
+        {
+            autoWarmup = getOpt<int>("TBENCH_AUTO_WARMUP", 0);
+            windowNs = getOpt<uint64_t>("TBENCH_AUTO_WARMUP_WINDOW_MS", 1000) *
+                1000 * 1000;
+            stableWindows = std::max(2, getOpt<int>(
+                        "TBENCH_AUTO_WARMUP_WINDOWS", 5));
+            tol = getOpt<double>("TBENCH_AUTO_WARMUP_TOL_PCT", 5.0) / 100.0;
+            maxWarmupNs = getOpt<uint64_t>("TBENCH_AUTO_WARMUP_MAX_S", 60) *
+                1000 * 1000 * 1000;
+            ciPct = getOpt<double>("TBENCH_ROI_CI_PCT", 0.0);
+            ciPctile = getOpt<double>("TBENCH_ROI_CI_PERCENTILE", 99.0);
+            if (windowNs == 0 || ciPct < 0 || ciPctile <= 0 ||
+                    ciPctile >= 100) {
+                std::cerr << "Invalid auto warmup or ROI CI options" \
+                    << std::endl;
+                exit(-1);
+            }
+
+            for (int i = 0; i < nthreads; ++i) slots.push_back(new Slot());
+
+            pthread_mutex_init(&lock, nullptr);
+            windowEndNs = 0;
+            windowStartNs = 0;
+            startNs = 0;
+            window = new Histogram();
+            roiLats = new Histogram();
+            roiFirstReq = UINT64_MAX;
+            roiStartNs = 0;
+            ended = false;
+        }
+
+        // Whether the options ask for a SteadyState at all. Reads them
+        // quietly; the constructor reports them.
+        static bool enabled() {
+            const char* autoWarmup = getenv("TBENCH_AUTO_WARMUP");
+            const char* ciPct = getenv("TBENCH_ROI_CI_PCT");
+            return (autoWarmup && atoi(autoWarmup)) ||
+                (ciPct && atof(ciPct) > 0);
+        }
+
+        // Thread id completed a request after latNs in the server
+        void record(int id, uint64_t latNs) {
+            Slot* slot = slots[id];
+            pthread_mutex_lock(&slot->lock);
+            slot->lats.record(latNs);
+            pthread_mutex_unlock(&slot->lock);
+        }
+
+        // Called after each group of completions, finished in all. Tells
+        // whether the ROI begins or ends with them, each exactly once.
+        void poll(uint64_t finished, bool* roiBegins, bool* roiEnds) {
+            *roiBegins = false;
+            *roiEnds = false;
+            if (ended) return;
+
+            uint64_t first = roiFirstReq;
+            if (first == UINT64_MAX) {
+                if (!autoWarmup && finished >= warmupReqs &&
+                        roiFirstReq.compare_exchange_strong(first, finished)) {
+                    roiStartNs = getCurNs();
+                    *roiBegins = true;
+                }
+            } else if (maxReqs && finished >= first + maxReqs) {
+                if (!ended.exchange(true)) *roiEnds = true;
+                return;
+            }
+
+            uint64_t curNs = getCurNs();
+            if (curNs < windowEndNs || pthread_mutex_trylock(&lock) != 0) {
+                return;
+            }
+
+            if (windowEndNs == 0) {
+                // Warmup starts with the first completion
+                startNs = curNs;
+            } else if (curNs >= windowEndNs) {
+                closeWindow(curNs, finished, roiBegins, roiEnds);
+            }
+            windowStartNs = curNs;
+            windowEndNs = curNs + windowNs;
+
+            pthread_mutex_unlock(&lock);
+        }
+};
+
+#endif
@@ -19,6 +19,8 @@
 
 #include <stdlib.h>
 
+#define TBENCH_MAX_REQ_CLASSES 16
+
 #ifdef __cplusplus 
 extern "C" {
 #endif
@@ -27,6 +29,14 @@ void tBenchClientInit();
 
 size_t tBenchClientGenReq(void* data);
 
+// Optional, called from tBenchClientGenReq() to tag the request being
+// generated with a class (0 to TBENCH_MAX_REQ_CLASSES - 1), such as its
+// transaction type. Once an app tags requests, the harness reports latencies
+// for each class as well as overall; untagged requests are class 0. name
+// (may be NULL) labels the class in the output, and only the first name
+// given for each class is kept.
+void tBenchClientSetReqClass(unsigned cls, const char* name);
+
 #ifdef __cplusplus 
 }
 #endif
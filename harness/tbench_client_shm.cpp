@@ -0,0 +1,29 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#include "client.h"
+#include "helpers.h"
+
+#include <string>
+
+static NetworkedClient* makeClient(int nthreads, int nconns) {
+    std::string name = getOpt<std::string>("TBENCH_SHM_NAME", "/tbench");
+    return new ShmClient(nthreads, name, nconns);
+}
+
+int main() {
+    return runNetworkedClient(makeClient);
+}
@@ -17,6 +17,7 @@
 #ifndef __TBENCH_SERVER_H
 #define __TBENCH_SERVER_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus 
@@ -33,6 +34,47 @@ size_t tBenchRecvReq(void** data);
 
 void tBenchSendResp(const void* data, size_t size);
 
+// Batched variants, for apps that can amortize work across requests. Blocks
+// until at least one request is available, then keeps collecting requests
+// until there are maxReqs (at least 1) of them or maxWaitUs have passed since the first
+// (0 = take only those already queued). Returns the number of requests n, with
+// the payload and size of each in data[0..n-1] and sizes[0..n-1], and the
+// handle to answer it with in handles[0..n-1]. Handles are only meaningful to
+// the calling thread, and every request in a batch must be answered before
+// the thread asks for the next one. Time spent waiting for a batch to fill up
+// counts as queueing time, not service time.
+size_t tBenchRecvReqBatch(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t maxWaitUs);
+
+// Answers n requests of the current batch, in any order and grouping. The
+// response to handles[i] is sizes[i] bytes at data[i].
+void tBenchSendRespBatch(const uint64_t* handles, const void* const* data,
+        const size_t* sizes, size_t n);
+
+// Asynchronous variants, for event-driven apps that keep many requests in
+// flight on each thread. Takes up to maxReqs requests that have arrived,
+// waiting up to timeoutUs for the first if none has (0 = do not wait,
+// TBENCH_WAIT_FOREVER = no limit), and returns how many it took. Unlike batch
+// handles, these are valid on any thread: a request may be answered from any
+// thread, at any time, and its payload stays valid until then. Requests past
+// the first 64K outstanding ones stay queued until some are answered. Service
+// time runs from when a request is taken to when it is answered.
+#define TBENCH_WAIT_FOREVER UINT64_MAX
+
+size_t tBenchRecvReqAsync(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t timeoutUs);
+
+// Answers a request taken with tBenchRecvReqAsync(), from any thread
+void tBenchSendRespAsync(uint64_t handle, const void* data, size_t size);
+
+// Callback style: calls handler for each request as it arrives, on the calling
+// thread, and never returns. The handler answers the request with
+// tBenchSendRespAsync(), right away or later and from any thread.
+typedef void (*tBenchReqHandler)(uint64_t handle, void* data, size_t size,
+        void* arg);
+
+void tBenchServeAsync(tBenchReqHandler handler, void* arg);
+
 #ifdef __cplusplus 
 }
 #endif
@@ -45,40 +45,146 @@
 IntegratedServer::IntegratedServer(int nthreads) 
     : Server(nthreads)
     , Client(nthreads)
-{ }
+{
+    heldReqs.resize(nthreads, nullptr);
+}
+
+// Requests arrive on the client's schedule. A batch takes those that arrive
+// within maxWaitNs of its first one, up to maxReqs, and closes when the wait
+// is over; the first request that arrives later starts the next batch.
+size_t IntegratedServer::recvReqBatch(int id, void** data, size_t* lens,
+        uint64_t* handles, size_t maxReqs, uint64_t maxWaitNs) {
+    Request* req = heldReqs[id] ? heldReqs[id] : Client::genReq();
+    heldReqs[id] = nullptr;
+    Client::issueReq(req);
+
+    uint64_t deadlineNs = getCurNs() + maxWaitNs;
+    std::vector<ReqInfo>& info = reqInfo[id];
+    info.clear();
+
+    while (true) {
+        ReqInfo ri = { req->id, 0, req->genNs, id }; // waitNs set below
+        data[info.size()] = reinterpret_cast<void*>(&req->data);
+        lens[info.size()] = req->len;
+        handles[info.size()] = info.size();
+        info.push_back(ri);
+        if (info.size() == maxReqs) break;
+
+        // Never waits on closed-loop users, who may be waiting on this batch
+        req = Client::genReq(false);
+        if (!req) break;
 
-size_t IntegratedServer::recvReq(int id, void** data) {
-    Request* req = Client::startReq();
-    *data = reinterpret_cast<void*>(&req->data);
+        if (req->genNs > deadlineNs) {
+            heldReqs[id] = req;
+            uint64_t curNs = getCurNs();
+            if (curNs < deadlineNs) {
+                sleepUntil(std::max(deadlineNs, curNs + minSleepNs));
+            }
+            break;
+        }
+        Client::issueReq(req);
+    }
+
+    // Service starts for the whole batch when the app gets it. Time since
+    // arrival is reported as waiting, though the client does not record it
     uint64_t curNs = getCurNs();
-    reqInfo[id].id = req->id;
-    reqInfo[id].startNs = curNs;
-    return req->len;
-};
-
-void IntegratedServer::sendResp(int id, const void* data, size_t len) {
-    Response* resp = new Response();
-    
-    resp->type = RESPONSE;
-    resp->id = reqInfo[id].id;
-    resp->len = len;
-    memcpy(reinterpret_cast<void*>(&resp->data), data, len);
+    for (ReqInfo& ri : info) {
+        ri.startNs = curNs;
+        ri.waitNs = (curNs > ri.waitNs) ? curNs - ri.waitNs : 0;
+    }
+
+    if (perf) perf->start(id);
+    return info.size();
+}
+
+void IntegratedServer::sendRespBatch(int id, const uint64_t* handles,
+        const void* const*, const size_t* lens, size_t n) {
+    // The client only looks at the header, so the payload is never copied
+    alignas(Response) char hdr[RESP_HDR_BYTES];
+    Response* resp = reinterpret_cast<Response*>(hdr);
 
     uint64_t curNs = getCurNs();
-    assert(curNs > reqInfo[id].startNs);
+    if (perf) perf->stop(id, n);
+    for (size_t i = 0; i < n; ++i) {
+        fillResp(resp, getReqInfo(id, handles[i]), lens[i], curNs);
+        if (perf) perf->record(id, resp->svcNs);
+        recordLatency(id, resp);
+        Client::finiReq(resp);
+    }
 
-    resp->svcNs = curNs - reqInfo[id].startNs;
+    finishReqs(n);
+}
 
-    Client::finiReq(resp);
+// Takes the requests that have arrived by now. If there are none, waits for
+// the next arrival if it comes before the timeout; a request due later is held
+// for the next call, as in recvReqBatch().
+size_t IntegratedServer::recvReqAsync(int id, void** data, size_t* lens,
+        uint64_t* handles, size_t maxReqs, uint64_t timeoutNs) {
+    bool forever = (timeoutNs == UINT64_MAX);
+    uint64_t deadlineNs = forever ? UINT64_MAX : getCurNs() + timeoutNs;
 
-    delete resp;
+    size_t n = 0;
+    uint64_t handle;
+    while (n < maxReqs && allocAsync(&handle)) {
+        Request* req = heldReqs[id] ? heldReqs[id] : 
+            Client::genReq(forever && n == 0);
+        heldReqs[id] = nullptr;
 
+        uint64_t curNs = getCurNs();
+        uint64_t dueNs = n ? curNs : deadlineNs;
+        if (!req || req->genNs > dueNs) {
+            heldReqs[id] = req;
+            freeAsync(handle);
+            if (n || curNs >= deadlineNs) break;
+
+            // Nothing arrives in time, or closed-loop users are all waiting
+            // on responses; the latter may change before the deadline
+            if (req) {
+                sleepUntil(std::max(deadlineNs, curNs + minSleepNs));
+                break;
+            }
+            sleepUntil(std::min(deadlineNs, curNs + minSleepNs));
+            continue;
+        }
+        Client::issueReq(req);
+
+        curNs = getCurNs();
+        ReqInfo& info = asyncInfo[handle];
+        info.id = req->id;
+        info.startNs = curNs;
+        info.waitNs = (curNs > req->genNs) ? curNs - req->genNs : 0;
+        info.tid = id;
+
+        data[n] = reinterpret_cast<void*>(&req->data);
+        lens[n] = req->len;
+        handles[n] = handle;
+        ++n;
+    }
+
+    return n;
+}
+
+void IntegratedServer::sendRespAsync(uint64_t handle, const void*,
+        size_t len) {
+    alignas(Response) char hdr[RESP_HDR_BYTES];
+    Response* resp = reinterpret_cast<Response*>(hdr);
+    const ReqInfo& info = getAsyncInfo(handle);
+    fillResp(resp, info, len, getCurNs());
+    int takerTid = info.tid;
+    freeAsync(handle);
+
+    recordLatency(takerTid, resp);
+    Client::finiReq(resp);
+    finishReqs(1);
+}
+
+void IntegratedServer::finishReqs(uint64_t n) {
     pthread_mutex_lock(&lock);
-    ++finishedReqs;
-    
-    if (finishedReqs == warmupReqs) {
-        Client::_startRoi();
-    } else if (finishedReqs == warmupReqs + maxReqs) {
+
+    bool roiBegins, roiEnds;
+    countFinished(n, &roiBegins, &roiEnds);
+    if (roiBegins) Client::_startRoi();
+    if (roiEnds) {
         Client::dumpStats();
         syscall(SYS_exit_group, 0);
     }
@@ -108,9 +214,11 @@ void tBenchServerInit(int nthreads) {
 
 void tBenchServerThreadStart() {
     tid = curTid++;
+    server->threadStart(tid);
 }
 
 void tBenchServerFinish() {
+    server->writePerf();
     server->dumpStats();
 }
 
@@ -122,3 +230,28 @@ void tBenchSendResp(const void* data, size_t size) {
     return server->sendResp(tid, data, size);
 }
 
+size_t tBenchRecvReqBatch(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t maxWaitUs) {
+    return server->recvReqBatch(tid, data, sizes, handles, maxReqs,
+            maxWaitUs * 1000);
+}
+
+void tBenchSendRespBatch(const uint64_t* handles, const void* const* data,
+        const size_t* sizes, size_t n) {
+    return server->sendRespBatch(tid, handles, data, sizes, n);
+}
+
+size_t tBenchRecvReqAsync(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t timeoutUs) {
+    return server->recvReqAsync(tid, data, sizes, handles, maxReqs,
+            (timeoutUs == TBENCH_WAIT_FOREVER) ? UINT64_MAX : 
+            timeoutUs * 1000);
+}
+
+void tBenchSendRespAsync(uint64_t handle, const void* data, size_t size) {
+    return server->sendRespAsync(handle, data, size);
+}
+
+void tBenchServeAsync(tBenchReqHandler handler, void* arg) {
+    server->serveAsync(tid, handler, arg);
+}
@@ -25,10 +25,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -41,22 +46,31 @@
 #include <sstream>
 #include <string>
 
+// Size of each connection's receive staging buffer. Requests that do not fit
+// are read straight into their own buffer instead.
+static const size_t RBUF_BYTES = 64 * 1024;
+
 /*******************************************************************************
  * NetworkedServer
  *******************************************************************************/
-NetworkedServer::NetworkedServer(int nthreads, std::string ip, int port, \
-        int nclients) 
-    : Server(nthreads)
+NetworkedServer::Conn::Conn(int idx, int fd, int epfd)
+    : idx(idx)
+    , fd(fd)
+    , epfd(epfd)
+    , closed(false)
+    , rlen(0)
+    , partial(nullptr)
+    , partialGot(0)
+    , waitingOut(false)
 {
+    rbuf = new char[RBUF_BYTES];
     pthread_mutex_init(&sendLock, nullptr);
-    pthread_mutex_init(&recvLock, nullptr);
-
-    reqbuf = new Request[nthreads]; 
-
-    activeFds.resize(nthreads);
-
-    recvClientHead = 0;
+}
 
+NetworkedServer::NetworkedServer(int nthreads, std::string ip, int port, \
+        int nclients) 
+    : QueuedServer(nthreads)
+{
     // Get address info
     int status;
     struct addrinfo hints;
@@ -104,6 +118,20 @@ NetworkedServer::NetworkedServer(int nthreads, std::string ip, int port, \
         exit(-1);
     }
 
+    // Set up I/O threads. Each owns an epoll instance and a share of the
+    // client connections
+    int nio = getOpt<int>("TBENCH_SERVER_IO_THREADS", 1);
+    ioThreads.resize(nio);
+    for (IoThread& io : ioThreads) {
+        io.server = this;
+        io.epfd = epoll_create1(0);
+        if (io.epfd == -1) {
+            std::cerr << "epoll_create1() failed: " << strerror(errno) \
+                << std::endl;
+            exit(-1);
+        }
+    }
+
     // Establish connections with clients
     struct sockaddr_storage clientAddr;
     socklen_t clientAddrSize;
@@ -129,166 +157,283 @@ NetworkedServer::NetworkedServer(int nthreads, std::string ip, int port, \
             exit(-1);
         }
 
-        clientFds.push_back(clientFd);
+        int flags = fcntl(clientFd, F_GETFL, 0);
+        if (flags == -1 || fcntl(clientFd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            std::cerr << "fcntl(O_NONBLOCK) failed: " << strerror(errno) \
+                << std::endl;
+            exit(-1);
+        }
+
+        IoThread& io = ioThreads[c % nio];
+        Conn* conn = new Conn(c, clientFd, io.epfd);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(io.epfd, EPOLL_CTL_ADD, clientFd, &ev) == -1) {
+            std::cerr << "epoll_ctl() failed: " << strerror(errno) << std::endl;
+            exit(-1);
+        }
+
+        conns.push_back(conn);
     }
-}
 
-NetworkedServer::~NetworkedServer() {
-    delete reqbuf;
+    liveConns = nclients;
+
+    for (IoThread& io : ioThreads) {
+        int status = pthread_create(&io.thread, nullptr, ioThreadMain, 
+                reinterpret_cast<void*>(&io));
+        assert(status == 0);
+    }
 }
 
-void NetworkedServer::removeClient(int fd) {
-    auto it = std::find(clientFds.begin(), clientFds.end(), fd);
-    clientFds.erase(it);
+void* NetworkedServer::ioThreadMain(void* ptr) {
+    IoThread* io = reinterpret_cast<IoThread*>(ptr);
+    io->server->ioLoop(io);
+    return nullptr;
 }
 
-bool NetworkedServer::checkRecv(int recvd, int expected, int fd) {
-    bool success = false;
-    if (recvd == 0) { // Client exited
-        std::cerr << "Client left, removing" << std::endl;
-        removeClient(fd);
-        success = false;
-    } else if (recvd == -1) {
-        std::cerr << "recv() failed: " << strerror(errno) \
-            << ". Exiting" << std::endl;
-        exit(-1);
-    } else {
-        if (recvd != expected) {
-            std::cerr << "ERROR! recvd = " << recvd << ", expected = " \
-                << expected << std::endl;
+void NetworkedServer::ioLoop(IoThread* io) {
+    const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(io->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait() failed: " << strerror(errno) \
+                << std::endl;
             exit(-1);
         }
-        // assert(recvd == expected);
-        success = true;
-    }
 
-    return success;
-}
+        for (int e = 0; e < n; ++e) {
+            Conn* conn = reinterpret_cast<Conn*>(events[e].data.ptr);
 
-size_t NetworkedServer::recvReq(int id, void** data) {
-    pthread_mutex_lock(&recvLock);
+            if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (!readConn(conn)) continue; // Client left
+            }
 
-    bool success = false;
-    Request* req;
-    int fd = -1;
+            if (events[e].events & EPOLLOUT) {
+                pthread_mutex_lock(&conn->sendLock);
+                flushConn(conn);
+                pthread_mutex_unlock(&conn->sendLock);
+            }
+        }
+    }
+}
 
-    while (!success && clientFds.size() > 0) {
-        int maxFd = -1;
-        fd_set readSet;
-        FD_ZERO(&readSet);
-        for (int f : clientFds) {
-            FD_SET(f, &readSet);
-            if (f > maxFd) maxFd = f;
+// Reads everything available on conn and queues each complete request.
+// Returns false if the client has left.
+bool NetworkedServer::readConn(Conn* conn) {
+    while (true) {
+        ssize_t recvd;
+        if (conn->partial) {
+            size_t total = REQ_HDR_BYTES + conn->partial->len;
+            recvd = recv(conn->fd, 
+                    reinterpret_cast<char*>(conn->partial) + conn->partialGot,
+                    total - conn->partialGot, 0);
+        } else {
+            recvd = recv(conn->fd, conn->rbuf + conn->rlen, 
+                    RBUF_BYTES - conn->rlen, 0);
         }
 
-        int ret = select(maxFd + 1, &readSet, nullptr, nullptr, nullptr);
-        if (ret == -1) {
-            std::cerr << "select() failed: " << strerror(errno) << std::endl;
+        if (recvd == 0 || (recvd == -1 && errno == ECONNRESET)) {
+            std::cerr << "Client left, removing" << std::endl;
+            closeConn(conn);
+            return false;
+        } else if (recvd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            std::cerr << "recv() failed: " << strerror(errno) \
+                << ". Exiting" << std::endl;
             exit(-1);
         }
 
-        fd = -1;
-
-        for (size_t i = 0; i < clientFds.size(); ++i) {
-            size_t idx = (recvClientHead + i) % clientFds.size();
-            if (FD_ISSET(clientFds[idx], &readSet)) {
-                fd = clientFds[idx];
-                break;
+        if (conn->partial) {
+            conn->partialGot += recvd;
+            if (conn->partialGot == REQ_HDR_BYTES + conn->partial->len) {
+                enqueueReq(conn->partial, conn->idx);
+                conn->partial = nullptr;
             }
+            continue;
         }
 
-        recvClientHead = (recvClientHead + 1) % clientFds.size();
-
-        assert(fd != -1);
+        conn->rlen += recvd;
+
+        // Decode every complete request in the staging buffer. A request
+        // whose header is in but whose payload is not moves to its own buffer
+        // right away, so at most a partial header is ever left behind
+        size_t off = 0;
+        while (conn->rlen - off >= REQ_HDR_BYTES) {
+            size_t len;
+            memcpy(&len, conn->rbuf + off + offsetof(Request, len), 
+                    sizeof(len));
+            if (len > static_cast<size_t>(MAX_REQ_BYTES)) {
+                std::cerr << "ERROR! Request of " << len << " bytes exceeds " \
+                    << "MAX_REQ_BYTES" << std::endl;
+                exit(-1);
+            }
 
-        int len = sizeof(Request) - MAX_REQ_BYTES; // Read request header first
+            size_t total = REQ_HDR_BYTES + len;
+            size_t avail = std::min(total, conn->rlen - off);
+            Request* req = reinterpret_cast<Request*>(bufPool.alloc(total));
+            memcpy(req, conn->rbuf + off, avail);
+            off += avail;
 
-        req = &reqbuf[id];
-        int recvd = recvfull(fd, reinterpret_cast<char*>(req), len, 0);
+            if (avail < total) {
+                conn->partial = req;
+                conn->partialGot = avail;
+                break;
+            }
 
-        success = checkRecv(recvd, len, fd);
-        if (!success) continue;
-        
-        recvd = recvfull(fd, req->data, req->len, 0);
+            enqueueReq(req, conn->idx);
+        }
 
-        success = checkRecv(recvd, req->len, fd);
-        if (!success) continue;
+        memmove(conn->rbuf, conn->rbuf + off, conn->rlen - off);
+        conn->rlen -= off;
     }
+}
+
+void NetworkedServer::closeConn(Conn* conn) {
+    pthread_mutex_lock(&conn->sendLock);
+    conn->closed = true;
+    for (auto& msg : conn->sendQueue) bufPool.release(msg.buf);
+    conn->sendQueue.clear();
+    epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+    pthread_mutex_unlock(&conn->sendLock);
 
-    if (clientFds.size() == 0) {
+    if (--liveConns == 0) {
         std::cerr << "All clients exited. Server finishing" << std::endl;
+        writePerf();
         exit(0);
-    } else {
-        uint64_t curNs = getCurNs();
-        reqInfo[id].id = req->id;
-        reqInfo[id].startNs = curNs;
-        activeFds[id] = fd;
-
-        *data = reinterpret_cast<void*>(&req->data);
     }
+}
 
-    pthread_mutex_unlock(&recvLock);
+// Writes as much of conn's send queue as the socket takes without blocking.
+// If the socket fills up, the owning I/O thread is asked to finish the job when
+// it drains. Returns true once the queue is empty. Caller holds conn->sendLock.
+bool NetworkedServer::flushConn(Conn* conn) {
+    while (!conn->sendQueue.empty() && !conn->closed) {
+        Conn::OutMsg& msg = conn->sendQueue.front();
+        ssize_t sent = send(conn->fd, msg.buf + msg.off, msg.len - msg.off, 
+                MSG_NOSIGNAL);
+
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!conn->waitingOut) {
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN | EPOLLOUT;
+                    ev.data.ptr = conn;
+                    epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+                    conn->waitingOut = true;
+                }
+                return false;
+            }
 
-    return req->len;
-};
+            // The client is gone; its I/O thread will notice and clean up
+            std::cerr << "send() failed: " << strerror(errno) << std::endl;
+            for (auto& m : conn->sendQueue) bufPool.release(m.buf);
+            conn->sendQueue.clear();
+            return true;
+        }
 
-void NetworkedServer::sendResp(int id, const void* data, size_t len) {
-    pthread_mutex_lock(&sendLock);
+        msg.off += sent;
+        if (msg.off == msg.len) {
+            bufPool.release(msg.buf);
+            conn->sendQueue.pop_front();
+        }
+    }
+
+    if (conn->waitingOut && !conn->closed) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->waitingOut = false;
+    }
 
-    Response* resp = new Response();
-    
-    resp->type = RESPONSE;
-    resp->id = reqInfo[id].id;
-    resp->len = len;
-    memcpy(reinterpret_cast<void*>(&resp->data), data, len);
+    return true;
+}
 
-    uint64_t curNs = getCurNs();
-    assert(curNs > reqInfo[id].startNs);
-    resp->svcNs = curNs - reqInfo[id].startNs;
+// Sends a message made of iovcnt pieces on conn. If nothing is queued on conn,
+// the pieces go straight to the socket with sendmsg() and are never copied;
+// only what the socket does not take right away is copied into a pooled buffer
+// and queued, since the caller may reuse its buffers once this returns.
+void NetworkedServer::sendMsg(int c, const struct iovec* iov, int iovcnt) {
+    Conn* conn = conns[c];
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
 
-    int fd = activeFds[id];
-    int totalLen = sizeof(Response) - MAX_RESP_BYTES + len;
-    int sent = sendfull(fd, reinterpret_cast<const char*>(resp), totalLen, 0);
-    assert(sent == totalLen);
+    pthread_mutex_lock(&conn->sendLock);
 
-    ++finishedReqs;
+    if (conn->closed) {
+        pthread_mutex_unlock(&conn->sendLock);
+        return;
+    }
 
-    if (finishedReqs == warmupReqs) {
-        resp->type = ROI_BEGIN;
-        for (int fd : clientFds) {
-            totalLen = sizeof(Response) - MAX_RESP_BYTES;
-            sent = sendfull(fd, reinterpret_cast<const char*>(resp), totalLen, 0);
-            assert(sent == totalLen);
+    size_t sent = 0;
+    if (conn->sendQueue.empty()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t res;
+        do {
+            res = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while (res == -1 && errno == EINTR);
+
+        if (res >= 0) {
+            sent = res;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // The client is gone; its I/O thread will notice and clean up
+            std::cerr << "sendmsg() failed: " << strerror(errno) << std::endl;
+            pthread_mutex_unlock(&conn->sendLock);
+            return;
         }
-    } else if (finishedReqs == warmupReqs + maxReqs) { 
-        resp->type = FINISH;
-        for (int fd : clientFds) {
-            totalLen = sizeof(Response) - MAX_RESP_BYTES;
-            sent = sendfull(fd, reinterpret_cast<const char*>(resp), totalLen, 0);
-            assert(sent == totalLen);
+    }
+
+    if (sent < total) {
+        Conn::OutMsg out = { bufPool.alloc(total - sent), total - sent, 0 };
+        char* dst = out.buf;
+        size_t skip = sent;
+        for (int i = 0; i < iovcnt; ++i) {
+            size_t len = iov[i].iov_len;
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            memcpy(dst, reinterpret_cast<const char*>(iov[i].iov_base) + skip,
+                    len - skip);
+            dst += len - skip;
+            skip = 0;
         }
+
+        conn->sendQueue.push_back(out);
+        flushConn(conn);
     }
 
-    delete resp;
-    
-    pthread_mutex_unlock(&sendLock);
+    pthread_mutex_unlock(&conn->sendLock);
 }
 
 void NetworkedServer::finish() {
-    pthread_mutex_lock(&sendLock);
-
-    Response* resp = new Response();
-    resp->type = FINISH;
-
-    for (int fd : clientFds) {
-        int len = sizeof(Response) - MAX_RESP_BYTES;
-        int sent = sendfull(fd, reinterpret_cast<const char*>(resp), len, 0);
-        assert(sent == len);
+    writePerf();
+
+    broadcast(FINISH);
+
+    // Make sure the FINISH markers are on the wire before the app exits
+    for (Conn* conn : conns) {
+        pthread_mutex_lock(&conn->sendLock);
+        while (!flushConn(conn)) {
+            pthread_mutex_unlock(&conn->sendLock);
+            struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+            pthread_mutex_lock(&conn->sendLock);
+        }
+        pthread_mutex_unlock(&conn->sendLock);
     }
-
-    delete resp;
-    
-    pthread_mutex_unlock(&sendLock);
 }
 
 /*******************************************************************************
@@ -315,6 +460,7 @@ void tBenchServerInit(int nthreads) {
 
 void tBenchServerThreadStart() {
     tid = curTid++;
+    server->threadStart(tid);
 }
 
 void tBenchServerFinish() {
@@ -329,3 +475,28 @@ void tBenchSendResp(const void* data, size_t size) {
     return server->sendResp(tid, data, size);
 }
 
+size_t tBenchRecvReqBatch(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t maxWaitUs) {
+    return server->recvReqBatch(tid, data, sizes, handles, maxReqs,
+            maxWaitUs * 1000);
+}
+
+void tBenchSendRespBatch(const uint64_t* handles, const void* const* data,
+        const size_t* sizes, size_t n) {
+    return server->sendRespBatch(tid, handles, data, sizes, n);
+}
+
+size_t tBenchRecvReqAsync(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t timeoutUs) {
+    return server->recvReqAsync(tid, data, sizes, handles, maxReqs,
+            (timeoutUs == TBENCH_WAIT_FOREVER) ? UINT64_MAX : 
+            timeoutUs * 1000);
+}
+
+void tBenchSendRespAsync(uint64_t handle, const void* data, size_t size) {
+    return server->sendRespAsync(handle, data, size);
+}
+
+void tBenchServeAsync(tBenchReqHandler handler, void* arg) {
+    server->serveAsync(tid, handler, arg);
+}
@@ -0,0 +1,246 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#include "tbench_server.h"
+
+#include "helpers.h"
+#include "server.h"
+#include "shm.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+
+// How often the poller checks that client processes are still alive
+static const uint64_t CLIENT_CHECK_NS = 100 * 1000 * 1000;
+
+/*******************************************************************************
+ * ShmServer
+ *******************************************************************************/
+ShmServer::ShmServer(int nthreads, std::string name, int nclients)
+    : QueuedServer(nthreads)
+{
+    spinNs = shmSpinNs();
+    size_t ringBytes = getOpt<size_t>("TBENCH_SHM_RING_KB", 4096) * 1024;
+
+    // A ring must hold at least one message of each kind
+    ringBytes = std::max(ringBytes, REQ_HDR_BYTES + MAX_REQ_BYTES);
+    ringBytes = std::max(ringBytes, RESP_HDR_BYTES + MAX_RESP_BYTES);
+
+    shm = shmCreate(name, nclients, ringBytes);
+
+    // Wait for all clients to attach. Once they have, nobody else needs to
+    // find the segment, so it is unlinked right away and goes away with the
+    // last process that maps it.
+    for (int c = 0; c < nclients; ++c) {
+        ShmChannel* chan = shm->channel(c);
+        while (chan->clientPid.load() == 0) usleep(1000);
+
+        Conn* conn = new Conn();
+        conn->chan = chan;
+        conn->closed = false;
+        pthread_mutex_init(&conn->sendLock, nullptr);
+        conns.push_back(conn);
+    }
+    shm_unlink(name.c_str());
+
+    liveConns = nclients;
+
+    int status = pthread_create(&poller, nullptr, pollerMain,
+            reinterpret_cast<void*>(this));
+    assert(status == 0);
+}
+
+void* ShmServer::pollerMain(void* ptr) {
+    reinterpret_cast<ShmServer*>(ptr)->pollLoop();
+    return nullptr;
+}
+
+void ShmServer::pollLoop() {
+    uint64_t lastCheckNs = getCurNs();
+
+    auto anyReqs = [this]() {
+        for (Conn* conn : conns) {
+            if (!conn->closed && !conn->chan->reqs.empty()) return true;
+        }
+        return false;
+    };
+
+    while (true) {
+        bool found = false;
+        for (size_t c = 0; c < conns.size(); ++c) {
+            if (conns[c]->closed) continue;
+            while (readReq(conns[c], c)) found = true;
+        }
+
+        // Clients exit without saying goodbye, so look for dead ones now and
+        // then; this is how the server learns that the run is over
+        uint64_t curNs = getCurNs();
+        if (curNs - lastCheckNs > CLIENT_CHECK_NS) {
+            checkClients();
+            lastCheckNs = curNs;
+        }
+
+        if (!found) shm->reqBell.wait(anyReqs, spinNs, CLIENT_CHECK_NS);
+    }
+}
+
+// Moves the oldest request on conn's ring into a pooled buffer and queues it.
+// Returns false if the ring is empty.
+bool ShmServer::readReq(Conn* conn, int idx) {
+    ShmRing& ring = conn->chan->reqs;
+    if (ring.empty()) return false;
+
+    char* base = reinterpret_cast<char*>(shm);
+
+    size_t len;
+    ring.peek(base, offsetof(Request, len), reinterpret_cast<char*>(&len),
+            sizeof(len));
+    if (len > static_cast<size_t>(MAX_REQ_BYTES)) {
+        std::cerr << "ERROR! Request of " << len << " bytes exceeds " \
+            << "MAX_REQ_BYTES" << std::endl;
+        exit(-1);
+    }
+
+    size_t total = REQ_HDR_BYTES + len;
+    Request* req = reinterpret_cast<Request*>(bufPool.alloc(total));
+    ring.peek(base, 0, reinterpret_cast<char*>(req), total);
+    ring.consume(total);
+
+    enqueueReq(req, idx);
+    return true;
+}
+
+void ShmServer::checkClients() {
+    for (Conn* conn : conns) {
+        if (conn->closed) continue;
+        pid_t pid = conn->chan->clientPid.load();
+        if (kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+        pthread_mutex_lock(&conn->sendLock);
+        conn->closed = true;
+        pthread_mutex_unlock(&conn->sendLock);
+
+        std::cerr << "Client left, removing" << std::endl;
+        if (--liveConns == 0) {
+            std::cerr << "All clients exited. Server finishing" << std::endl;
+            writePerf();
+            exit(0);
+        }
+    }
+}
+
+// Workers replying on the same connection take turns on its response ring. If
+// the ring is full, waits for the client to drain it.
+void ShmServer::sendMsg(int c, const struct iovec* iov, int iovcnt) {
+    Conn* conn = conns[c];
+    ShmRing& ring = conn->chan->resps;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) total += iov[i].iov_len;
+
+    pthread_mutex_lock(&conn->sendLock);
+    while (!conn->closed && ring.space() < total) {
+        pthread_mutex_unlock(&conn->sendLock);
+        sched_yield();
+        pthread_mutex_lock(&conn->sendLock);
+    }
+
+    if (!conn->closed) {
+        ring.write(reinterpret_cast<char*>(shm), iov, iovcnt);
+        conn->chan->respBell.ring();
+    }
+    pthread_mutex_unlock(&conn->sendLock);
+}
+
+void ShmServer::finish() {
+    writePerf();
+
+    // Messages are in the rings as soon as sendMsg() returns
+    broadcast(FINISH);
+}
+
+/*******************************************************************************
+ * Per-thread State
+ *******************************************************************************/
+__thread int tid;
+
+/*******************************************************************************
+ * Global data
+ *******************************************************************************/
+std::atomic_int curTid;
+ShmServer* server;
+
+/*******************************************************************************
+ * API
+ *******************************************************************************/
+void tBenchServerInit(int nthreads) {
+    curTid = 0;
+    std::string name = getOpt<std::string>("TBENCH_SHM_NAME", "/tbench");
+    int nclients = getOpt<int>("TBENCH_NCLIENTS", 1);
+    server = new ShmServer(nthreads, name, nclients);
+}
+
+void tBenchServerThreadStart() {
+    tid = curTid++;
+    server->threadStart(tid);
+}
+
+void tBenchServerFinish() {
+    server->finish();
+}
+
+size_t tBenchRecvReq(void** data) {
+    return server->recvReq(tid, data);
+}
+
+void tBenchSendResp(const void* data, size_t size) {
+    return server->sendResp(tid, data, size);
+}
+
+size_t tBenchRecvReqBatch(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t maxWaitUs) {
+    return server->recvReqBatch(tid, data, sizes, handles, maxReqs,
+            maxWaitUs * 1000);
+}
+
+void tBenchSendRespBatch(const uint64_t* handles, const void* const* data,
+        const size_t* sizes, size_t n) {
+    return server->sendRespBatch(tid, handles, data, sizes, n);
+}
+
+size_t tBenchRecvReqAsync(void** data, size_t* sizes, uint64_t* handles,
+        size_t maxReqs, uint64_t timeoutUs) {
+    return server->recvReqAsync(tid, data, sizes, handles, maxReqs,
+            (timeoutUs == TBENCH_WAIT_FOREVER) ? UINT64_MAX : 
+            timeoutUs * 1000);
+}
+
+void tBenchSendRespAsync(uint64_t handle, const void* data, size_t size) {
+    return server->sendRespAsync(handle, data, size);
+}
+
+void tBenchServeAsync(tBenchReqHandler handler, void* arg) {
+    server->serveAsync(tid, handler, arg);
+}
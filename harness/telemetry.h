@@ -0,0 +1,151 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __TELEMETRY_H
+#define __TELEMETRY_H
+
+#include "helpers.h"
+#include "hist.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Live view of a run in progress. A reporter thread closes a window every
+// intervalNs and appends one CSV line with the window's throughput and latency
+// percentiles, followed by whatever gauges the owner reports, to a file that is
+// flushed line by line (so it can be followed with tail -f). Rows carry the
+// wall-clock time, to line them up with application logs.
+class Telemetry {
+    public:
+        // Latencies recorded by one thread in the current window. The owner
+        // locks it per sample and the reporter once per window, so the lock
+        // is all but uncontended
+        struct Slot {
+            pthread_mutex_t lock;
+            Histogram lats;
+
+            Slot() { pthread_mutex_init(&lock, nullptr); }
+        };
+
+        // Appends the gauge columns named in the constructor's gaugeHdr,
+        // each preceded by a comma
+        typedef std::function<void(std::ostream&)> GaugeFn;
+
+    private:
+        std::ofstream out;
+        uint64_t intervalNs;
+        GaugeFn gauges;
+
+        pthread_mutex_t slotsLock;
+        std::vector<Slot*> slots;
+
+        pthread_t thread;
+
+        static void* reporterMain(void* ptr) {
+            reinterpret_cast<Telemetry*>(ptr)->report();
+            return nullptr;
+        }
+
+        void report() {
+            Histogram* window = new Histogram();
+            uint64_t startNs = getCurNs();
+
+            while (true) {
+                sleepUntil(startNs + intervalNs);
+                uint64_t endNs = getCurNs();
+
+                window->reset();
+                pthread_mutex_lock(&slotsLock);
+                for (Slot* slot : slots) {
+                    pthread_mutex_lock(&slot->lock);
+                    window->merge(slot->lats);
+                    slot->lats.reset();
+                    pthread_mutex_unlock(&slot->lock);
+                }
+                pthread_mutex_unlock(&slotsLock);
+
+                struct timespec wall;
+                clock_gettime(CLOCK_REALTIME, &wall);
+
+                out << wall.tv_sec << "." << std::setw(3) << std::setfill('0') \
+                    << wall.tv_nsec / 1000000 << std::setfill(' ') << "," \
+                    << std::fixed << std::setprecision(1) \
+                    << window->count() * 1e9 / (endNs - startNs) << "," \
+                    << window->percentile(50.0) << "," \
+                    << window->percentile(99.0) << "," \
+                    << window->percentile(99.9) << "," << window->max();
+                gauges(out);
+                out << std::endl;
+
+                startNs = endNs;
+            }
+        }
+
+    public:
+        // intervalNs is the window length. gaugeHdr names the gauge columns,
+        // each preceded by a comma
+        Telemetry(const std::string& path, uint64_t intervalNs,
+                const std::string& gaugeHdr, GaugeFn gauges)
+            : out(path.c_str())
+            , intervalNs(intervalNs)
+            , gauges(gauges)
+        {
+            if (!out.is_open()) {
+                std::cerr << "Could not open telemetry file " << path \
+                    << std::endl;
+                exit(-1);
+            }
+            out << "unix_time,qps,p50_ns,p99_ns,p999_ns,max_ns" << gaugeHdr \
+                << std::endl;
+
+            pthread_mutex_init(&slotsLock, nullptr);
+
+            int status = pthread_create(&thread, nullptr, reporterMain, this);
+            if (status != 0) {
+                std::cerr << "pthread_create() failed: " << strerror(status) \
+                    << std::endl;
+                exit(-1);
+            }
+            pthread_detach(thread);
+        }
+
+        // Slots are never freed; there is one per recording thread
+        Slot* newSlot() {
+            Slot* slot = new Slot();
+            pthread_mutex_lock(&slotsLock);
+            slots.push_back(slot);
+            pthread_mutex_unlock(&slotsLock);
+            return slot;
+        }
+
+        static void record(Slot* slot, uint64_t latNs) {
+            pthread_mutex_lock(&slot->lock);
+            slot->lats.record(latNs);
+            pthread_mutex_unlock(&slot->lock);
+        }
+};
+
+#endif
@@ -56,15 +56,13 @@ class Client {
             int req = distrib(randGen);
             assert(req < totalImgs);
 
-            SerializedMat smat;
             cv::Rect test_roi = cv::Rect(req, 0, 1, testX.rows);
             Mat single_testX = testX(test_roi);
 
-            smat.serialize(single_testX);
-            size_t len = sizeof(smat);
-            memcpy(buf, reinterpret_cast<const void*>(&smat), len);
+            SerializedImg* img = reinterpret_cast<SerializedImg*>(buf);
+            img->serialize(single_testX);
 
-            return len;
+            return sizeof(SerializedImg);
         }
 };
 
@@ -5,10 +5,11 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
-static const int SparseAutoencoderLayers = 2;
 static const int nclasses = 10;
 
 typedef struct SparseAutoencoder{
@@ -35,34 +36,18 @@ typedef struct SoftmaxRegession{
     double cost;
 } SMR;
 
-struct SerializedMat {
-    static const int rows = 28*28; // Each MNIST image is 28*28
-    static const int cols = 1;
-    static const int type = CV_64FC1;
+// A request: one MNIST image as its raw pixels, 0-255. The server scales them
+// to [0, 1] as its first layer reads them.
+struct SerializedImg {
+    static const int pixels = 28*28; // Each MNIST image is 28*28
 
-    double data[rows * cols];
+    uint8_t data[pixels];
 
+    // From a column of pixels scaled to [0, 1], as readData() returns them
     void serialize(const cv::Mat& mat) {
-        double* ptr = data;
-
-        for (int r = 0; r < rows; ++r) {
-            for (int c = 0; c < cols; ++c) {
-                *ptr++ = mat.at<double>(r, c);
-            }
-        }
-    }
-
-    cv::Mat deserialize() {
-        cv::Mat mat = cv::Mat::zeros(rows, cols, type);
-        double* ptr = data;
-        for (int r = 0; r < rows; ++r) {
-            for (int c = 0; c < cols; ++c) {
-                double& val = mat.at<double>(r, c);
-                val = *ptr++;
-            }
+        for (int r = 0; r < pixels; ++r) {
+            data[r] = cvRound(mat.at<double>(r, 0) * 255.0);
         }
-
-        return mat;
     }
 };
 
@@ -0,0 +1,135 @@
+// Writes binary models of random weights, of any depth and width, so that
+// img-dnn can be run with models from a few KB up to many GB without training
+// them. Their classes are meaningless, but the server does the same work per
+// request as with a trained model of that shape.
+
+#include "inference.h"
+#include "modelfile.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const int inputs = 28 * 28; // Pixels per image, as the client sends them
+
+void printHelp(char* argv[]) {
+    std::cerr << std::endl;
+    std::cerr << "Usage: " << argv[0] << " [-o model_file]" \
+        << " [-d hidden_layers]" << " [-w hidden_layer_size[,...]]" \
+        << " [-c classes]" << " [-p fp64|fp32|int8]" << " [-s seed]" \
+        << std::endl << std::endl;
+    std::cerr << "-o : File to write the model to (default: model.bin)" \
+        << std::endl << std::endl;
+    std::cerr << "-d : Number of hidden layers (default: 2)" << std::endl \
+        << std::endl;
+    std::cerr << "-w : Outputs of each hidden layer, or a comma-separated " \
+        << "list with one per hidden layer, which sets their number too " \
+        << "(default: 600)" << std::endl << std::endl;
+    std::cerr << "-c : Outputs of the softmax layer (default: 10)" \
+        << std::endl << std::endl;
+    std::cerr << "-p : Precision of the stored weights (default: fp64)" \
+        << std::endl << std::endl;
+    std::cerr << "-s : Random seed (default: 1)" << std::endl << std::endl;
+    std::cerr << "-h : Print this help and exit" << std::endl << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string modelFile = "model.bin";
+    int hiddenLayers = 2;
+    std::vector<int> hiddenSizes(1, 600);
+    int classes = 10;
+    Precision precision = FP64;
+    uint64_t seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "o:d:w:c:p:s:h")) != -1) {
+        switch(c) {
+            case 'o':
+                modelFile = optarg;
+                break;
+            case 'd':
+                hiddenLayers = atoi(optarg);
+                break;
+            case 'w': {
+                hiddenSizes.clear();
+                std::stringstream ss(optarg);
+                std::string size;
+                while (std::getline(ss, size, ',')) {
+                    hiddenSizes.push_back(atoi(size.c_str()));
+                }
+                break;
+            }
+            case 'c':
+                classes = atoi(optarg);
+                break;
+            case 'p':
+                if (!parsePrecision(optarg, &precision)) {
+                    std::cerr << "Unknown precision " << optarg << std::endl;
+                    printHelp(argv);
+                    return -1;
+                }
+                break;
+            case 's':
+                seed = strtoull(optarg, nullptr, 10);
+                break;
+            case 'h':
+                printHelp(argv);
+                return 0;
+                break;
+            case '?':
+                printHelp(argv);
+                return -1;
+                break;
+        }
+    }
+
+    if (hiddenSizes.size() == 1) {
+        hiddenSizes.assign(hiddenLayers < 0 ? 0 : hiddenLayers, hiddenSizes[0]);
+    }
+    std::vector<int> widths(1, inputs);
+    widths.insert(widths.end(), hiddenSizes.begin(), hiddenSizes.end());
+    widths.push_back(classes);
+
+    uint64_t nweights = 0;
+    for (size_t l = 1; l < widths.size(); ++l) {
+        if (widths[l] < 1) {
+            std::cerr << "Every layer needs at least one output" << std::endl;
+            return -1;
+        }
+        nweights += (uint64_t)widths[l] * widths[l - 1];
+    }
+
+    // Uniform in +-sqrt(6 / (fan-in + fan-out + 1)) rather than train's fixed
+    // +-0.12, which would saturate the sigmoids of wide layers
+    std::mt19937_64 gen(seed);
+    ModelFileWriter writer(modelFile, precision, widths);
+    std::vector<double> row;
+    for (size_t l = 1; l < widths.size(); ++l) {
+        double epsilon = sqrt(6.0 / (widths[l] + widths[l - 1] + 1));
+        std::uniform_real_distribution<double> dist(-epsilon, epsilon);
+
+        row.resize(widths[l - 1]);
+        for (int j = 0; j < widths[l]; ++j) {
+            for (double& w : row) w = dist(gen);
+            writer.addRow(row.data());
+        }
+        if (l < widths.size() - 1) {
+            row.resize(widths[l]);
+            for (double& b : row) b = dist(gen);
+            writer.addBias(row.data());
+        }
+    }
+    writer.finish();
+
+    std::cerr << "Wrote " << modelFile << ": " << widths.size() - 2 \
+        << " hidden layers, " << nweights << " " << precisionName(precision) \
+        << " weights" << std::endl;
+    return 0;
+}
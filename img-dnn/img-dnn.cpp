@@ -8,6 +8,8 @@
 // softmax regression, and fine-tune the whole network.
 
 #include "common.h"
+#include "inference.h"
+#include "modelfile.h"
 #include "tbench_server.h"
 
 #include "opencv2/core/core.hpp"
@@ -18,6 +20,7 @@
 #include <math.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -30,49 +33,52 @@ using namespace std;
 #define ATD at<double>
 #define elif else if
 
-Mat 
-resultProdict(const Mat &x, const vector<SA> &hLayers, const SMR &smr){
-
-    vector<Mat> acti;
-    acti.push_back(x);
-    for(int i=1; i<=SparseAutoencoderLayers; i++){
-        Mat tmpacti = hLayers[i - 1].W1 * acti[i - 1] + repeat(hLayers[i - 1].b1, 1, x.cols);
-        acti.push_back(sigmoid(tmpacti));
+// Views a weight or bias matrix as a raw array, which the forward pass reads
+// in place
+static const double* rawData(const Mat& mat, const char* name) {
+    if (mat.type() != CV_64FC1 || !mat.isContinuous()) {
+        cerr << "Model matrix " << name << " is not a dense matrix of " \
+            << "doubles" << endl;
+        exit(-1);
     }
-    Mat M = smr.Weight * acti[acti.size() - 1];
-    Mat tmp;
-    reduce(M, tmp, 0, CV_REDUCE_MAX);
-    M = M + repeat(tmp, M.rows, 1);
-    Mat p;
-    exp(M, p);
-    reduce(p, tmp, 0, CV_REDUCE_SUM);
-    divide(p, repeat(tmp, p.rows, 1), p);
-    log(p, tmp);
-    //cout<<tmp.t()<<endl;
-    Mat result = Mat::ones(1, tmp.cols, CV_64FC1);
-    for(int i=0; i<tmp.cols; i++){
-        double maxele = tmp.ATD(0, i);
-        int which = 0;
-        for(int j=1; j<tmp.rows; j++){
-            if(tmp.ATD(j, i) > maxele){
-                maxele = tmp.ATD(j, i);
-                which = j;
-            }
+    return mat.ptr<double>();
+}
+
+// Stacks all of the model's hidden layers, however many and wide they are,
+// under its softmax layer
+Network buildNetwork(const SMR& smr, const vector<SA>& hiddenLayers) {
+    Network net;
+    for (size_t i = 0; i < hiddenLayers.size(); ++i) {
+        const SA& sa = hiddenLayers[i];
+        DenseLayer layer = { sa.W1.rows, sa.W1.cols, rawData(sa.W1, "W1"),
+            rawData(sa.b1, "b1") };
+        if (sa.b1.total() != (size_t)layer.rows) {
+            cerr << "Hidden layer " << i << " has " << sa.b1.total() \
+                << " biases for " << layer.rows << " outputs" << endl;
+            exit(-1);
         }
-        result.ATD(0, i) = which;
+        net.hidden.push_back(layer);
     }
-    acti.clear();
 
-    return result;
+    DenseLayer output = { smr.Weight.rows, smr.Weight.cols, 
+        rawData(smr.Weight, "Weight"), nullptr };
+    net.output = output;
+
+    if (!net.consistent()) {
+        cerr << "Model layer sizes do not match up" << endl;
+        exit(-1);
+    }
+
+    return net;
 }
 
+// Reads a model as train saves it. Only the matrices classification uses are
+// converted; the decoder weights, gradients and costs are only for training.
 void loadModel(SMR& smr, vector<SA>& HiddenLayers, string modelFile) {
     FileStorage fs(modelFile, FileStorage::READ);
 
     FileNode smrNode = fs["smr"];
     smrNode["Weight"] >> smr.Weight;
-    smrNode["Wgrad"] >> smr.Wgrad;
-    smrNode["cost"] >> smr.cost;
 
     HiddenLayers.clear();
     FileNode layersNode = fs["HiddenLayers"];
@@ -80,28 +86,78 @@ void loadModel(SMR& smr, vector<SA>& HiddenLayers, string modelFile) {
     for (auto it = layersNode.begin(); it != layersNode.end(); ++it) {
         SA sa;
         (*it)["W1"] >> sa.W1;
-        (*it)["W2"] >> sa.W2;
         (*it)["b1"] >> sa.b1;
-        (*it)["b2"] >> sa.b2;
-        (*it)["W1grad"] >> sa.W1grad;
-        (*it)["W2grad"] >> sa.W2grad;
-        (*it)["b1grad"] >> sa.b1grad;
-        (*it)["b2grad"] >> sa.b2grad;
-        (*it)["cost"] >> sa.cost;
 
         HiddenLayers.push_back(sa);
     }
 }
 
+// Classifies the MNIST test set at each precision, and reports how often each
+// is right and how often it agrees with FP64
+void checkAccuracy(Network& net, const string& mnistDir) {
+    const int nimgs = 10000;
+    const int batch = 64;
+
+    Mat testX, testY;
+    readData(testX, testY, mnistDir + "/t10k-images-idx3-ubyte",
+            mnistDir + "/t10k-labels-idx1-ubyte", nimgs);
+
+    // As requests carry them
+    vector<SerializedImg> imgs(nimgs);
+    vector<const uint8_t*> images(nimgs);
+    for (int i = 0; i < nimgs; ++i) {
+        imgs[i].serialize(testX.col(i));
+        images[i] = imgs[i].data;
+    }
+
+    vector<int> baseline;
+    for (Precision precision : { FP64, FP32, INT8 }) {
+        net.prepare(precision);
+        Inference inference(net, batch);
+        vector<int> classes(nimgs);
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < nimgs; i += batch) {
+            inference.classify(&images[i], min(batch, nimgs - i), &classes[i]);
+        }
+        chrono::duration<double, micro> elapsed = 
+            chrono::steady_clock::now() - start;
+
+        if (precision == FP64) baseline = classes;
+        int correct = 0, agree = 0;
+        for (int i = 0; i < nimgs; ++i) {
+            correct += (classes[i] == (int)testY.ATD(0, i));
+            agree += (classes[i] == baseline[i]);
+        }
+
+        cout << precisionName(precision) << ": accuracy " \
+            << (double)correct / nimgs << ", agrees with fp64 on " \
+            << (double)agree / nimgs << " of images, " \
+            << elapsed.count() / nimgs << " us/image" << endl;
+    }
+}
+
 void printHelp(char* argv[]) {
     cerr << endl;
     cerr << "Usage: " << argv[0] << " [-f model_file] [-n max_reqs]" \
-        << " [-r threads] [-h]" << endl << endl;
-    cerr << "-f : Name of model file to load " << "(default: model.xml)" \
-        << endl; 
+        << " [-r threads] [-b batch_size] [-w batch_wait_us]" \
+        << " [-p precision] [-t mnist_dir] [-o out_file] [-h]" << endl \
+        << endl;
+    cerr << "-f : Name of model file to load, as saved by train or in " \
+        << "binary (default: model.xml)" << endl; 
     cerr << "-n : Maximum number of requests "\
         << "(default: 6000; size of the full MNIST test dataset)" << endl;
     cerr << "-r : Number of worker threads" << endl;
+    cerr << "-b : Most requests classified together in one forward pass " \
+        << "(default: 1)" << endl;
+    cerr << "-w : How long, in us, a batch may wait for more requests after " \
+        << "its first (default: 0; take only those already queued)" << endl;
+    cerr << "-p : Arithmetic of the forward pass: fp64, fp32 or int8 " \
+        << "(default: that of a binary model, else fp64)" << endl;
+    cerr << "-t : Check the accuracy of each precision on the MNIST test " \
+        << "set in this directory, and exit" << endl;
+    cerr << "-o : Save the model to this file in binary, with weights in " \
+        << "the -p precision, and exit" << endl;
     cerr << "-h : Print this help and exit" << endl;
 }
 
@@ -114,14 +170,11 @@ class Worker {
         static atomic_llong nReqsTotal;
         static long maxReqs;
         static atomic_llong correct;
+        static size_t batchSize;
+        static uint64_t batchWaitUs;
+        static atomic_flag badLenWarned;
 
-        SMR smr;
-        vector<SA> hiddenLayers;
-
-        long startReq() {
-            ++nReqs;
-            return ++nReqsTotal;
-        }
+        const Network& net;
 
         static void* run(void* ptr) {
             Worker* worker = reinterpret_cast<Worker*>(ptr);
@@ -130,31 +183,77 @@ class Worker {
             return nullptr;
         }
 
+        // Requests that are queued together are classified together, so
+        // each row of weights is read from memory once per batch instead of
+        // once per image
         void doRun() {
             tBenchServerThreadStart();
 
-            SerializedMat* smat;
-            Result res;
-            while (++nReqsTotal <= maxReqs) {
-                ++nReqs;
-
-                size_t len = tBenchRecvReq(reinterpret_cast<void**>(&smat));
-
-                cv::Mat single_testX = smat->deserialize();
-
-                Mat result = resultProdict(single_testX, hiddenLayers, smr);
-
-                res.res = result.at<double>(0, 0);
-                tBenchSendResp(reinterpret_cast<const void*>(&res), sizeof(res));
+            vector<void*> reqs(batchSize);
+            vector<size_t> reqLens(batchSize);
+            vector<uint64_t> handles(batchSize);
+            vector<Result> results(batchSize);
+            vector<const void*> resps(batchSize);
+            vector<size_t> respLens(batchSize, sizeof(Result));
+            for (size_t i = 0; i < batchSize; ++i) resps[i] = &results[i];
+
+            Inference inference(net, batchSize);
+            vector<const uint8_t*> images(batchSize);
+            vector<int> classes(batchSize);
+            vector<size_t> imgReqs(batchSize); // Request of each image
+            while (true) {
+                // Claim at most a batch of what is left of the request budget
+                // before taking requests, so workers together never take
+                // more than maxReqs, and give back what the batch did not
+                // use. A worker still holding a claim always comes back for
+                // what it returns, so the last worker to stop has served all
+                // maxReqs.
+                long long cur = nReqsTotal;
+                long long want;
+                do {
+                    if (cur >= maxReqs) return;
+                    want = min<long long>(batchSize, maxReqs - cur);
+                } while (!nReqsTotal.compare_exchange_weak(cur, cur + want));
+
+                size_t n = tBenchRecvReqBatch(reqs.data(), reqLens.data(),
+                        handles.data(), want, batchWaitUs);
+                nReqs += n;
+                nReqsTotal -= want - n;
+
+                // Images are read in place, from the requests. Requests
+                // that do not hold exactly one image are answered with
+                // class -1 rather than read past their end.
+                size_t nimgs = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    results[i].res = -1;
+                    if (reqLens[i] != sizeof(SerializedImg)) {
+                        if (!badLenWarned.test_and_set()) {
+                            cerr << "Rejecting request of " << reqLens[i] \
+                                << " bytes, expected " \
+                                << sizeof(SerializedImg) << endl;
+                        }
+                        continue;
+                    }
+                    imgReqs[nimgs] = i;
+                    images[nimgs++] =
+                        reinterpret_cast<SerializedImg*>(reqs[i])->data;
+                }
+
+                inference.classify(images.data(), nimgs, classes.data());
+
+                for (size_t k = 0; k < nimgs; ++k) {
+                    results[imgReqs[k]].res = classes[k];
+                }
+                tBenchSendRespBatch(handles.data(), resps.data(),
+                        respLens.data(), n);
             }
         }
 
     public:
-        Worker(int tid, const SMR& _smr, const vector<SA>& _hiddenLayers)
+        Worker(int tid, const Network& net)
             : tid(tid) 
             , nReqs(0)
-            , smr(_smr)
-            , hiddenLayers(_hiddenLayers)
+            , net(net)
         { }
 
         void run() {
@@ -169,11 +268,19 @@ class Worker {
 
         static void updateMaxReqs(long _maxReqs) { maxReqs = _maxReqs; }
 
+        static void setBatching(size_t _batchSize, uint64_t _batchWaitUs) {
+            batchSize = _batchSize;
+            batchWaitUs = _batchWaitUs;
+        }
+
 };
 
 atomic_llong Worker::nReqsTotal(0);
 long Worker::maxReqs(0);
 atomic_llong Worker::correct(0);
+size_t Worker::batchSize(1);
+uint64_t Worker::batchWaitUs(0);
+atomic_flag Worker::badLenWarned = ATOMIC_FLAG_INIT;
 
 int 
 main(int argc, char** argv)
@@ -181,9 +288,15 @@ main(int argc, char** argv)
     string modelFile = "model.xml";
     int maxReqs = 6000; // Full MNIST test dataset
     int nThreads = 1;
+    int batchSize = 1;
+    uint64_t batchWaitUs = 0;
+    Precision precision = FP64;
+    bool precisionSet = false;
+    string mnistDir;
+    string outFile;
 
     int c;
-    while ((c = getopt(argc, argv, "f:n:r:h")) != -1) {
+    while ((c = getopt(argc, argv, "f:n:r:b:w:p:t:o:h")) != -1) {
         switch(c) {
             case 'f':
                 modelFile = optarg;
@@ -194,6 +307,26 @@ main(int argc, char** argv)
             case 'r':
                 nThreads = atoi(optarg);
                 break;
+            case 'b':
+                batchSize = atoi(optarg);
+                break;
+            case 'w':
+                batchWaitUs = strtoull(optarg, nullptr, 10);
+                break;
+            case 'p':
+                if (!parsePrecision(optarg, &precision)) {
+                    cerr << "Unknown precision " << optarg << endl;
+                    printHelp(argv);
+                    return -1;
+                }
+                precisionSet = true;
+                break;
+            case 't':
+                mnistDir = optarg;
+                break;
+            case 'o':
+                outFile = optarg;
+                break;
             case 'h':
                 printHelp(argv);
                 return 0;
@@ -205,19 +338,47 @@ main(int argc, char** argv)
         }
     }
 
+    if (batchSize < 1) {
+        cerr << "Batch size must be at least 1" << endl;
+        return -1;
+    }
+
     long start, end;
     start = clock();
 
     vector<SA> HiddenLayers;
     SMR smr;
 
-    loadModel(smr, HiddenLayers, modelFile);
+    Network net;
+    if (isModelFile(modelFile)) {
+        loadModelFile(modelFile, &net);
+    } else {
+        loadModel(smr, HiddenLayers, modelFile);
+        net = buildNetwork(smr, HiddenLayers);
+    }
+    if (net.inputs() != SerializedImg::pixels) {
+        cerr << "Model takes " << net.inputs() << " inputs, but images have " \
+            << SerializedImg::pixels << " pixels" << endl;
+        return -1;
+    }
+    if (!precisionSet) precision = net.precision;
+
+    if (!outFile.empty()) {
+        saveModelFile(outFile, net, precision);
+        return 0;
+    }
+    if (!mnistDir.empty()) {
+        checkAccuracy(net, mnistDir);
+        return 0;
+    }
+    net.prepare(precision);
 
     tBenchServerInit(nThreads);
     Worker::updateMaxReqs(maxReqs);
+    Worker::setBatching(batchSize, batchWaitUs);
     vector<Worker> workers;
     for (int t = 0; t < nThreads; ++t) {
-        workers.push_back(Worker(t, smr, HiddenLayers));
+        workers.push_back(Worker(t, net));
     }
 
     for (int t = 0; t < nThreads; ++t) {
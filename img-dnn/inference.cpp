@@ -0,0 +1,409 @@
+#include "inference.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+bool parsePrecision(const std::string& name, Precision* precision) {
+    if (name == "fp64") *precision = FP64;
+    else if (name == "fp32") *precision = FP32;
+    else if (name == "int8") *precision = INT8;
+    else return false;
+    return true;
+}
+
+const char* precisionName(Precision precision) {
+    switch (precision) {
+        case FP32: return "fp32";
+        case INT8: return "int8";
+        default: return "fp64";
+    }
+}
+
+/*******************************************************************************
+ * Dot-product kernels. The build targets the baseline ISA, so the wider
+ * variants are compiled for their own targets and one of each is picked at
+ * startup for the CPU it runs on. Each handles its remainder with the scalar
+ * loop.
+ *******************************************************************************/
+static double dotF64Scalar(const double* w, const double* x, int len) {
+    double acc = 0.0;
+    for (int k = 0; k < len; ++k) acc += w[k] * x[k];
+    return acc;
+}
+
+static float dotF32Scalar(const float* w, const float* x, int len) {
+    float acc = 0.0f;
+    for (int k = 0; k < len; ++k) acc += w[k] * x[k];
+    return acc;
+}
+
+// Products of uint8 activations and int8 weights fit in int16, and each pair
+// of them in int32 (madd_epi16 and dpbusd sum pairs/quads without saturating)
+static int32_t dotI8Scalar(const int8_t* w, const uint8_t* x, int len) {
+    int32_t acc = 0;
+    for (int k = 0; k < len; ++k) acc += (int32_t)w[k] * x[k];
+    return acc;
+}
+
+#ifdef KERNELS_X86
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#define TARGET_VNNI __attribute__((target("avx512f,avx512bw,avx512vnni")))
+
+TARGET_AVX2 static inline double hsum(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+            _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+TARGET_AVX2 static inline float hsum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+            _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+TARGET_AVX2 static inline int32_t hsum(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+            _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+TARGET_AVX2 static double dotF64Avx2(const double* w, const double* x,
+        int len) {
+    int k = 0;
+    __m256d v0 = _mm256_setzero_pd(), v1 = _mm256_setzero_pd();
+    for (; k + 8 <= len; k += 8) {
+        v0 = _mm256_fmadd_pd(_mm256_loadu_pd(w + k), _mm256_loadu_pd(x + k),
+                v0);
+        v1 = _mm256_fmadd_pd(_mm256_loadu_pd(w + k + 4),
+                _mm256_loadu_pd(x + k + 4), v1);
+    }
+    return hsum(_mm256_add_pd(v0, v1)) + dotF64Scalar(w + k, x + k, len - k);
+}
+
+TARGET_AVX512 static double dotF64Avx512(const double* w, const double* x,
+        int len) {
+    int k = 0;
+    __m512d v0 = _mm512_setzero_pd(), v1 = _mm512_setzero_pd();
+    for (; k + 16 <= len; k += 16) {
+        v0 = _mm512_fmadd_pd(_mm512_loadu_pd(w + k), _mm512_loadu_pd(x + k),
+                v0);
+        v1 = _mm512_fmadd_pd(_mm512_loadu_pd(w + k + 8),
+                _mm512_loadu_pd(x + k + 8), v1);
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(v0, v1)) +
+        dotF64Scalar(w + k, x + k, len - k);
+}
+
+TARGET_AVX2 static float dotF32Avx2(const float* w, const float* x, int len) {
+    int k = 0;
+    __m256 v0 = _mm256_setzero_ps(), v1 = _mm256_setzero_ps();
+    for (; k + 16 <= len; k += 16) {
+        v0 = _mm256_fmadd_ps(_mm256_loadu_ps(w + k), _mm256_loadu_ps(x + k),
+                v0);
+        v1 = _mm256_fmadd_ps(_mm256_loadu_ps(w + k + 8),
+                _mm256_loadu_ps(x + k + 8), v1);
+    }
+    return hsum(_mm256_add_ps(v0, v1)) + dotF32Scalar(w + k, x + k, len - k);
+}
+
+TARGET_AVX512 static float dotF32Avx512(const float* w, const float* x,
+        int len) {
+    int k = 0;
+    __m512 v0 = _mm512_setzero_ps(), v1 = _mm512_setzero_ps();
+    for (; k + 32 <= len; k += 32) {
+        v0 = _mm512_fmadd_ps(_mm512_loadu_ps(w + k), _mm512_loadu_ps(x + k),
+                v0);
+        v1 = _mm512_fmadd_ps(_mm512_loadu_ps(w + k + 16),
+                _mm512_loadu_ps(x + k + 16), v1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(v0, v1)) +
+        dotF32Scalar(w + k, x + k, len - k);
+}
+
+TARGET_AVX2 static int32_t dotI8Avx2(const int8_t* w, const uint8_t* x,
+        int len) {
+    int k = 0;
+    __m256i v = _mm256_setzero_si256();
+    for (; k + 16 <= len; k += 16) {
+        __m256i xs = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(x + k)));
+        __m256i ws = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(w + k)));
+        v = _mm256_add_epi32(v, _mm256_madd_epi16(xs, ws));
+    }
+    return hsum(v) + dotI8Scalar(w + k, x + k, len - k);
+}
+
+TARGET_AVX512 static int32_t dotI8Avx512(const int8_t* w, const uint8_t* x,
+        int len) {
+    int k = 0;
+    __m512i v = _mm512_setzero_si512();
+    for (; k + 32 <= len; k += 32) {
+        __m512i xs = _mm512_cvtepu8_epi16(_mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(x + k)));
+        __m512i ws = _mm512_cvtepi8_epi16(_mm256_loadu_si256(
+                    reinterpret_cast<const __m256i*>(w + k)));
+        v = _mm512_add_epi32(v, _mm512_madd_epi16(xs, ws));
+    }
+    return _mm512_reduce_add_epi32(v) + dotI8Scalar(w + k, x + k, len - k);
+}
+
+TARGET_VNNI static int32_t dotI8Vnni(const int8_t* w, const uint8_t* x,
+        int len) {
+    int k = 0;
+    __m512i v = _mm512_setzero_si512();
+    for (; k + 64 <= len; k += 64) {
+        v = _mm512_dpbusd_epi32(v, _mm512_loadu_si512(x + k),
+                _mm512_loadu_si512(w + k));
+    }
+    return _mm512_reduce_add_epi32(v) + dotI8Scalar(w + k, x + k, len - k);
+}
+#endif
+
+struct DotKernels {
+    double (*f64)(const double*, const double*, int);
+    float (*f32)(const float*, const float*, int);
+    int32_t (*i8)(const int8_t*, const uint8_t*, int);
+};
+
+// Runs during static initialization, hence the explicit cpu_init
+static DotKernels pickDotKernels() {
+    DotKernels k = { dotF64Scalar, dotF32Scalar, dotI8Scalar };
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        k.f64 = dotF64Avx2;
+        k.f32 = dotF32Avx2;
+        k.i8 = dotI8Avx2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw")) {
+        k.f64 = dotF64Avx512;
+        k.f32 = dotF32Avx512;
+        k.i8 = __builtin_cpu_supports("avx512vnni") ? dotI8Vnni : dotI8Avx512;
+    }
+#endif
+    return k;
+}
+
+static const DotKernels dot = pickDotKernels();
+
+/*******************************************************************************
+ * Precisions. Each says how activations are stored, and computes a layer's
+ * output j, before bias and activation function, from one image's inputs.
+ *******************************************************************************/
+static inline double sigmoid(double a) { return 1.0 / (1.0 + exp(-a)); }
+
+// Pixels are converted as they are; the first layer's outputs are then scaled
+// by pixelScale instead of every input
+struct KernelF64 {
+    typedef double Act;
+    static constexpr double pixelScale = 1.0 / 255.0;
+    static Act quantize(double v) { return v; }
+    static double output(const DenseLayer& l, int j, const Act* x) {
+        return dot.f64(l.weights + (size_t)j * l.cols, x, l.cols);
+    }
+};
+
+struct KernelF32 {
+    typedef float Act;
+    static constexpr double pixelScale = 1.0 / 255.0;
+    static Act quantize(double v) { return v; }
+    static double output(const DenseLayer& l, int j, const Act* x) {
+        return dot.f32(l.weightsF32 + (size_t)j * l.cols, x, l.cols);
+    }
+};
+
+// Pixels already are activations in steps of 1/255, and are read in place.
+// Wide layers are summed in chunks short enough that int32 cannot overflow.
+struct KernelI8 {
+    typedef uint8_t Act; // In steps of 1/255
+    static constexpr double pixelScale = 1.0;
+    static const int CHUNK = 1 << 15; // 2^15 * 255 * 127 < 2^31
+    static Act quantize(double v) {
+        return std::max(0L, std::min(255L, lrint(v * 255.0)));
+    }
+    static double output(const DenseLayer& l, int j, const Act* x) {
+        const int8_t* w = l.weightsI8 + (size_t)j * l.cols;
+        int64_t acc = 0;
+        for (int k = 0; k < l.cols; k += CHUNK) {
+            acc += dot.i8(w + k, x + k, std::min(CHUNK, l.cols - k));
+        }
+        return l.scalesI8[j] * (acc * (1.0 / 255.0));
+    }
+};
+
+/*******************************************************************************
+ * Network
+ *******************************************************************************/
+void DenseLayer::getRow(int j, double* row) const {
+    size_t off = (size_t)j * cols;
+    for (int k = 0; k < cols; ++k) {
+        if (weights) row[k] = weights[off + k];
+        else if (weightsF32) row[k] = weightsF32[off + k];
+        else row[k] = scalesI8[j] * weightsI8[off + k];
+    }
+}
+
+// Symmetric per-row quantization
+float quantizeRow(const double* row, int len, int8_t* q) {
+    double maxAbs = 0.0;
+    for (int k = 0; k < len; ++k) maxAbs = std::max(maxAbs, fabs(row[k]));
+
+    double scale = maxAbs ? maxAbs / 127.0 : 1.0;
+    for (int k = 0; k < len; ++k) q[k] = lrint(row[k] / scale);
+    return scale;
+}
+
+static void convertF64(DenseLayer& layer, std::vector<double>& store) {
+    store.resize((size_t)layer.rows * layer.cols);
+    for (int j = 0; j < layer.rows; ++j) {
+        layer.getRow(j, &store[(size_t)j * layer.cols]);
+    }
+    layer.weights = store.data();
+}
+
+static void convertF32(DenseLayer& layer, std::vector<float>& store) {
+    std::vector<double> row(layer.cols);
+    store.resize((size_t)layer.rows * layer.cols);
+    for (int j = 0; j < layer.rows; ++j) {
+        layer.getRow(j, row.data());
+        std::copy(row.begin(), row.end(), &store[(size_t)j * layer.cols]);
+    }
+    layer.weightsF32 = store.data();
+}
+
+static void convertI8(DenseLayer& layer, std::vector<int8_t>& store,
+        std::vector<float>& scales) {
+    std::vector<double> row(layer.cols);
+    store.resize((size_t)layer.rows * layer.cols);
+    scales.resize(layer.rows);
+    for (int j = 0; j < layer.rows; ++j) {
+        layer.getRow(j, row.data());
+        scales[j] = quantizeRow(row.data(), layer.cols, 
+                &store[(size_t)j * layer.cols]);
+    }
+    layer.weightsI8 = store.data();
+    layer.scalesI8 = scales.data();
+}
+
+void Network::prepare(Precision p) {
+    precision = p;
+    std::vector<DenseLayer*> layers;
+    for (DenseLayer& layer : hidden) layers.push_back(&layer);
+    layers.push_back(&output);
+
+    for (DenseLayer* layer : layers) {
+        if (p == FP64 && !layer->weights) {
+            f64Store.emplace_back();
+            convertF64(*layer, f64Store.back());
+        } else if (p == FP32 && !layer->weightsF32) {
+            f32Store.emplace_back();
+            convertF32(*layer, f32Store.back());
+        } else if (p == INT8 && !layer->weightsI8) {
+            i8Store.emplace_back();
+            f32Store.emplace_back();
+            convertI8(*layer, i8Store.back(), f32Store.back());
+        }
+    }
+}
+
+bool Network::consistent() const {
+    int width = inputs();
+    for (const DenseLayer& layer : hidden) {
+        if (layer.cols != width || !layer.bias) return false;
+        width = layer.rows;
+    }
+    return output.cols == width && output.rows > 0;
+}
+
+/*******************************************************************************
+ * Inference
+ *******************************************************************************/
+Inference::Inference(const Network& net, int maxBatch)
+    : net(net)
+    , maxBatch(maxBatch)
+    , inBuf((size_t)net.inputs() * maxBatch)
+    , inPtrs(maxBatch)
+{
+    size_t width = net.output.rows;
+    for (const DenseLayer& layer : net.hidden) {
+        width = std::max(width, (size_t)layer.rows);
+    }
+    for (std::vector<double>& buf : bufs) buf.resize(width * maxBatch);
+}
+
+template<typename K>
+void Inference::forward(const uint8_t* const* images, int n, int* classes) {
+    typedef typename K::Act Act;
+    const Act** in = reinterpret_cast<const Act**>(inPtrs.data());
+
+    int inputs = net.inputs();
+    for (int i = 0; i < n; ++i) {
+        if (sizeof(Act) == 1) {
+            in[i] = reinterpret_cast<const Act*>(images[i]);
+            continue;
+        }
+        Act* x = reinterpret_cast<Act*>(inBuf.data()) + (size_t)i * inputs;
+        std::copy(images[i], images[i] + inputs, x);
+        in[i] = x;
+    }
+
+    // out[i * rows + j] = sigmoid(bias[j] + W[j] . in[i]). Each row of
+    // weights is used for the whole batch while it is in cache.
+    int cur = 0;
+    double scale = K::pixelScale;
+    for (const DenseLayer& layer : net.hidden) {
+        Act* out = reinterpret_cast<Act*>(bufs[cur].data());
+        for (int j = 0; j < layer.rows; ++j) {
+            double b = layer.bias[j];
+            for (int i = 0; i < n; ++i) {
+                double a = b + scale * K::output(layer, j, in[i]);
+                out[(size_t)i * layer.rows + j] = K::quantize(sigmoid(a));
+            }
+        }
+
+        for (int i = 0; i < n; ++i) in[i] = out + (size_t)i * layer.rows;
+        cur ^= 1;
+        scale = 1.0;
+    }
+
+    // Argmax of the softmax layer's inputs, one weight row at a time
+    const DenseLayer& layer = net.output;
+    double* best = bufs[cur].data();
+    for (int j = 0; j < layer.rows; ++j) {
+        for (int i = 0; i < n; ++i) {
+            double score = scale * K::output(layer, j, in[i]);
+            if (j == 0 || score > best[i]) {
+                best[i] = score;
+                classes[i] = j;
+            }
+        }
+    }
+}
+
+void Inference::classify(const uint8_t* const* images, int n, int* classes) {
+    switch (net.precision) {
+        case FP32:
+            forward<KernelF32>(images, n, classes);
+            break;
+        case INT8:
+            forward<KernelI8>(images, n, classes);
+            break;
+        default:
+            forward<KernelF64>(images, n, classes);
+            break;
+    }
+}
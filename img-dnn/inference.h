@@ -0,0 +1,93 @@
+#ifndef __INFERENCE_H
+#define __INFERENCE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Arithmetic the forward pass runs in. FP64 is the model as trained. FP32
+// halves the bytes of weights read per image. INT8 quantizes each row of
+// weights to int8 with a scale of its own, and activations (which sigmoid and
+// the input pixels keep in [0, 1]) to uint8 steps of 1/255, so dot products
+// are integer multiply-adds on a quarter of FP32's bytes.
+enum Precision { FP64, FP32, INT8 };
+
+bool parsePrecision(const std::string& name, Precision* precision);
+const char* precisionName(Precision precision);
+
+// A fully-connected layer, as the forward pass sees it: rows outputs, each the
+// dot product of a row of weights (row-major, rows x cols) with the cols
+// inputs, plus a bias if there is one. Weights may be held in any of the
+// precisions; Network::prepare() fills in the one in use from another.
+struct DenseLayer {
+    int rows;
+    int cols;
+    const double* weights;
+    const double* bias;
+
+    const float* weightsF32;
+    const int8_t* weightsI8;
+    const float* scalesI8; // Row j of weights ~= scalesI8[j] * weightsI8 row j
+
+    // Sets row to row j of the weights, from whichever precision holds them
+    void getRow(int j, double* row) const;
+};
+
+// Quantizes len weights to int8 in q, mapping the largest to +-127, and
+// returns the scale that maps them back
+float quantizeRow(const double* row, int len, int8_t* q);
+
+// The classifier: sigmoid hidden layers, then a softmax layer whose most
+// probable output is the class. Softmax is monotonic, so only its inputs are
+// ever computed. Weights are borrowed, not copied, and shared by all workers.
+struct Network {
+    std::vector<DenseLayer> hidden;
+    DenseLayer output;
+    Precision precision;
+
+    // Converted weights the layers point into
+    std::vector<std::vector<double>> f64Store;
+    std::vector<std::vector<float>> f32Store;
+    std::vector<std::vector<int8_t>> i8Store;
+
+    Network() : precision(FP64) {}
+
+    // Converts the weights for precision, if needed, and uses it from then
+    // on. Layers must not change afterwards.
+    void prepare(Precision precision);
+
+    int inputs() const { return hidden.empty() ? output.cols : hidden[0].cols; }
+
+    // Whether each layer takes as many inputs as the one before has outputs
+    bool consistent() const;
+};
+
+// Runs the forward pass for one worker thread. Activations live in buffers
+// sized for maxBatch images up front, and bias and sigmoid are applied as each
+// output is produced, so classifying never allocates.
+class Inference {
+    private:
+        const Network& net;
+        int maxBatch;
+
+        // Pixels converted to the precision in use, then the activations of
+        // the layer being read and the one being written, one image after
+        // another. Doubles are just the widest element type.
+        std::vector<double> inBuf;
+        std::vector<double> bufs[2];
+        std::vector<const void*> inPtrs;
+
+        template<typename K>
+        void forward(const uint8_t* const* images, int n, int* classes);
+
+    public:
+        Inference(const Network& net, int maxBatch);
+
+        // Sets classes[i] to the class of the image at images[i], for n
+        // (at most maxBatch) images of net.inputs() pixels each. Pixels range
+        // over 0-255, and are scaled to [0, 1] as the first layer reads them.
+        void classify(const uint8_t* const* images, int n, int* classes);
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include "modelfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+static const uint64_t ALIGN = 64;
+
+static size_t weightBytes(Precision precision) {
+    switch (precision) {
+        case FP32: return sizeof(float);
+        case INT8: return sizeof(int8_t);
+        default: return sizeof(double);
+    }
+}
+
+bool isModelFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(MODEL_FILE_MAGIC)];
+    return in.read(magic, sizeof(magic)) &&
+        memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+static void badModel(const std::string& path, const char* why) {
+    std::cerr << "Model file " << path << " is malformed: " << why \
+        << std::endl;
+    exit(-1);
+}
+
+void loadModelFile(const std::string& path, Network* net) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        std::cerr << "Could not open model file " << path << ": " \
+            << strerror(errno) << std::endl;
+        exit(-1);
+    }
+
+    // Populated up front, so requests do not take the page faults
+    size_t len = st.st_size;
+    void* map = (len < sizeof(ModelFileHeader)) ? MAP_FAILED :
+        mmap(nullptr, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) badModel(path, "too short");
+    const char* base = reinterpret_cast<const char*>(map);
+
+    const ModelFileHeader* hdr = reinterpret_cast<const ModelFileHeader*>(base);
+    if (memcmp(hdr->magic, MODEL_FILE_MAGIC, sizeof(hdr->magic)) != 0) {
+        badModel(path, "bad magic");
+    }
+    if (hdr->precision > INT8) badModel(path, "unknown precision");
+    Precision precision = static_cast<Precision>(hdr->precision);
+    if (hdr->nlayers < 1 || sizeof(ModelFileHeader) +
+            (uint64_t)hdr->nlayers * sizeof(ModelFileLayer) > len) {
+        badModel(path, "bad layer table");
+    }
+
+    // Checks that an array of bytes at off lies in the file, and returns it
+    auto array = [&](uint64_t off, uint64_t bytes) -> const void* {
+        if (off % ALIGN || off > len || bytes > len - off) {
+            badModel(path, "array out of bounds");
+        }
+        return base + off;
+    };
+
+    const ModelFileLayer* layers =
+        reinterpret_cast<const ModelFileLayer*>(hdr + 1);
+    net->hidden.clear();
+    for (uint32_t l = 0; l < hdr->nlayers; ++l) {
+        const ModelFileLayer& fl = layers[l];
+        bool isOutput = (l == hdr->nlayers - 1);
+        uint64_t n = (uint64_t)fl.rows * fl.cols;
+
+        if (fl.rows == 0 || fl.cols == 0 || (!isOutput && !fl.biasOff)) {
+            badModel(path, "bad layer");
+        }
+
+        DenseLayer layer = {};
+        layer.rows = fl.rows;
+        layer.cols = fl.cols;
+        const void* weights = array(fl.weightsOff, n * weightBytes(precision));
+        if (precision == FP64) {
+            layer.weights = reinterpret_cast<const double*>(weights);
+        } else if (precision == FP32) {
+            layer.weightsF32 = reinterpret_cast<const float*>(weights);
+        } else {
+            layer.weightsI8 = reinterpret_cast<const int8_t*>(weights);
+            layer.scalesI8 = reinterpret_cast<const float*>(
+                    array(fl.scalesOff, fl.rows * sizeof(float)));
+        }
+        if (!isOutput) {
+            layer.bias = reinterpret_cast<const double*>(
+                    array(fl.biasOff, fl.rows * sizeof(double)));
+            net->hidden.push_back(layer);
+        } else {
+            net->output = layer;
+        }
+    }
+
+    if (!net->consistent()) badModel(path, "layer sizes do not match up");
+    net->precision = precision;
+}
+
+ModelFileWriter::ModelFileWriter(const std::string& path,
+        Precision precision, const std::vector<int>& widths)
+    : path(path)
+    , precision(precision)
+    , out(path, std::ios::binary | std::ios::trunc)
+    , layer(0)
+    , row(0)
+{
+    if (widths.size() < 2) fail("no layers");
+
+    // Lay out the arrays after the layer table
+    table.resize(widths.size() - 1);
+    uint64_t off = sizeof(ModelFileHeader) +
+        table.size() * sizeof(ModelFileLayer);
+    auto place = [&](uint64_t bytes) {
+        off = (off + ALIGN - 1) / ALIGN * ALIGN;
+        uint64_t res = off;
+        off += bytes;
+        return res;
+    };
+    for (size_t l = 0; l < table.size(); ++l) {
+        ModelFileLayer& fl = table[l];
+        if (widths[l] <= 0 || widths[l + 1] <= 0) fail("empty layer");
+        fl.rows = widths[l + 1];
+        fl.cols = widths[l];
+        fl.weightsOff = place((uint64_t)fl.rows * fl.cols *
+                weightBytes(precision));
+        fl.scalesOff = (precision == INT8) ?
+            place(fl.rows * sizeof(float)) : 0;
+        bool isOutput = (l == table.size() - 1);
+        fl.biasOff = isOutput ? 0 : place(fl.rows * sizeof(double));
+    }
+
+    ModelFileHeader hdr;
+    memcpy(hdr.magic, MODEL_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.nlayers = table.size();
+    hdr.precision = precision;
+    pos = 0;
+    put(0, &hdr, sizeof(hdr));
+    put(pos, table.data(), table.size() * sizeof(ModelFileLayer));
+}
+
+void ModelFileWriter::fail(const char* why) {
+    std::cerr << "Could not write model file " << path << ": " << why \
+        << std::endl;
+    exit(-1);
+}
+
+void ModelFileWriter::put(uint64_t at, const void* data, uint64_t bytes) {
+    static const char zeros[ALIGN] = {};
+    out.write(zeros, at - pos);
+    out.write(reinterpret_cast<const char*>(data), bytes);
+    pos = at + bytes;
+}
+
+void ModelFileWriter::addRow(const double* weights) {
+    if (layer == table.size()) fail("too many rows");
+    const ModelFileLayer& fl = table[layer];
+    uint64_t at = fl.weightsOff + (uint64_t)row * fl.cols *
+        weightBytes(precision);
+
+    if (precision == FP64) {
+        put(at, weights, fl.cols * sizeof(double));
+    } else if (precision == FP32) {
+        rowF32.assign(weights, weights + fl.cols);
+        put(at, rowF32.data(), fl.cols * sizeof(float));
+    } else {
+        rowI8.resize(fl.cols);
+        scales.resize(fl.rows);
+        scales[row] = quantizeRow(weights, fl.cols, rowI8.data());
+        put(at, rowI8.data(), fl.cols);
+    }
+
+    if (++row < fl.rows) return;
+    if (precision == INT8) {
+        put(fl.scalesOff, scales.data(), fl.rows * sizeof(float));
+    }
+    if (!fl.biasOff) {
+        row = 0;
+        ++layer;
+    }
+}
+
+void ModelFileWriter::addBias(const double* bias) {
+    if (layer == table.size() || row < table[layer].rows ||
+            !table[layer].biasOff) {
+        fail("biases out of order");
+    }
+    put(table[layer].biasOff, bias, table[layer].rows * sizeof(double));
+    row = 0;
+    ++layer;
+}
+
+void ModelFileWriter::finish() {
+    if (layer < table.size()) fail("model incomplete");
+    out.flush();
+    if (!out) fail(strerror(errno));
+}
+
+void saveModelFile(const std::string& path, const Network& net,
+        Precision precision) {
+    std::vector<const DenseLayer*> layers;
+    for (const DenseLayer& layer : net.hidden) layers.push_back(&layer);
+    layers.push_back(&net.output);
+
+    std::vector<int> widths(1, net.inputs());
+    for (const DenseLayer* layer : layers) widths.push_back(layer->rows);
+
+    ModelFileWriter writer(path, precision, widths);
+    std::vector<double> row;
+    for (const DenseLayer* layer : layers) {
+        row.resize(layer->cols);
+        for (int j = 0; j < layer->rows; ++j) {
+            layer->getRow(j, row.data());
+            writer.addRow(row.data());
+        }
+        if (layer->bias) writer.addBias(layer->bias);
+    }
+    writer.finish();
+}
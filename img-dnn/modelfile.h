@@ -0,0 +1,78 @@
+#ifndef __MODELFILE_H
+#define __MODELFILE_H
+
+#include "inference.h"
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary model files. A header and a table of layers (the hidden layers in
+// order, then the softmax layer) are followed by each layer's weights, in the
+// file's precision, and biases, in doubles. Every array starts at a multiple
+// of 64 bytes, so a mapped file is used in place: loading takes no parsing or
+// copying, and workers and processes that map the same file share its pages.
+
+static const char MODEL_FILE_MAGIC[8] = { 't', 'b', 'd', 'n', 'n', 'b',
+    'i', 'n' };
+
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t nlayers; // Including the softmax layer
+    uint32_t precision; // A Precision
+};
+
+struct ModelFileLayer {
+    uint32_t rows;
+    uint32_t cols;
+    uint64_t weightsOff; // From the start of the file
+    uint64_t scalesOff; // INT8 only
+    uint64_t biasOff; // 0 for the softmax layer
+};
+
+// Whether path starts like a binary model file
+bool isModelFile(const std::string& path);
+
+// Maps the model at path, read-only, and points net's layers into it. Exits
+// with an error if the file is malformed.
+void loadModelFile(const std::string& path, Network* net);
+
+// Writes net as a binary model file with weights in the given precision
+void saveModelFile(const std::string& path, const Network& net,
+        Precision precision);
+
+// Writes a binary model file a row at a time, converting each to the file's
+// precision as it goes, so models far larger than memory can be written.
+// widths lists the inputs, then each layer's outputs, the softmax layer last.
+// Each layer's rows come in order, then (for hidden layers) its biases.
+class ModelFileWriter {
+    private:
+        std::string path;
+        Precision precision;
+        std::vector<ModelFileLayer> table;
+        std::ofstream out;
+        uint64_t pos;
+
+        size_t layer; // Being written
+        uint32_t row; // Next of its rows
+        std::vector<float> rowF32;
+        std::vector<int8_t> rowI8;
+        std::vector<float> scales;
+
+        void put(uint64_t at, const void* data, uint64_t bytes);
+        void fail(const char* why);
+
+    public:
+        ModelFileWriter(const std::string& path, Precision precision,
+                const std::vector<int>& widths);
+
+        void addRow(const double* weights);
+        void addBias(const double* bias);
+
+        // Exits with an error unless the whole model was written out
+        void finish();
+};
+
+#endif
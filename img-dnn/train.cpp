@@ -244,10 +244,11 @@ fineTuneNetworkCost(cv::Mat &x, cv::Mat &y, std::vector<SA> &hLayers, SMR &smr,
 
     int nfeatures = x.rows;
     int nsamples = x.cols;
+    int nlayers = hLayers.size();
     std::vector<cv::Mat> acti;
 
     acti.push_back(x);
-    for(int i=1; i<=SparseAutoencoderLayers; i++){
+    for(int i=1; i<=nlayers; i++){
         cv::Mat tmpacti = hLayers[i - 1].W1 * acti[i - 1] + repeat(hLayers[i - 1].b1, 1, x.cols);
         acti.push_back(sigmoid(tmpacti));
     }
@@ -282,7 +283,7 @@ fineTuneNetworkCost(cv::Mat &x, cv::Mat &y, std::vector<SA> &hLayers, SMR &smr,
         delta[i] = hLayers[i].W1.t() * delta[i + 1];
         delta[i] = delta[i].mul(dsigmoid(acti[i]));
     }
-    for(int i=SparseAutoencoderLayers - 1; i >=0; i--){
+    for(int i=nlayers - 1; i >=0; i--){
         hLayers[i].W1grad = delta[i + 1] * acti[i].t();
         hLayers[i].W1grad /= nsamples;
         reduce(delta[i + 1], tmp, 1, CV_REDUCE_SUM);
@@ -328,13 +329,18 @@ void printHelp(char* argv[]) {
     std::cerr << std::endl;
     std::cerr << "Usage: " << argv[0] << " [-m mnist_dir]"  \
         << " [-f model_file]" << " [-t training_set_size]" \
-        << " [-i max_training_iters]" << std::endl << std::endl;
+        << " [-i max_training_iters]" << " [-l hidden_layers]" \
+        << " [-s hidden_layer_size]" << std::endl << std::endl;
     std::cerr << "-m : Directory where mnist data is stored (default: .mnist)" \
         << std::endl << std::endl;
     std::cerr << "-f : File to save model to" << std::endl << std::endl;
     std::cerr << "-t : Size of training set" << std::endl << std::endl;
     std::cerr << "-f : Maximum iterations during training" << std::endl \
         << std::endl;
+    std::cerr << "-l : Number of hidden layers (default: 2)" << std::endl \
+        << std::endl;
+    std::cerr << "-s : Outputs of each hidden layer (default: 600)" \
+        << std::endl << std::endl;
     std::cerr << "-h : Print this help and exit" << std::endl << std::endl;
 }
 
@@ -344,9 +350,11 @@ int main(int argc, char* argv[]) {
     std::string modelFile = "model.xml";
     int trainingSetSize = 60000; // Full MNIST training dataset
     int maxTrainingIter = 80000; // Max iters in original code
+    int hiddenLayers = 2;
+    int hiddenSize = 600;
 
     int c;
-    while ((c = getopt(argc, argv, "m:f:t:i:h")) != -1) {
+    while ((c = getopt(argc, argv, "m:f:t:i:l:s:h")) != -1) {
         switch(c) {
             case 'm':
                 mnistDataDir = optarg;
@@ -360,6 +368,12 @@ int main(int argc, char* argv[]) {
             case 'i':
                 maxTrainingIter = atoi(optarg);
                 break;
+            case 'l':
+                hiddenLayers = atoi(optarg);
+                break;
+            case 's':
+                hiddenSize = atoi(optarg);
+                break;
             case 'h':
                 printHelp(argv);
                 return 0;
@@ -371,6 +385,12 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (hiddenLayers < 1 || hiddenSize < 1) {
+        std::cerr << "Need at least one hidden layer of at least one output" \
+            << std::endl;
+        return -1;
+    }
+
     std::vector<SA> HiddenLayers;
     SMR smr;
 
@@ -401,11 +421,11 @@ int main(int argc, char* argv[]) {
     // normX.copyTo(trainX);
 
     std::vector<cv::Mat> Activations;
-    for(int i=0; i<SparseAutoencoderLayers; i++){
+    for(int i=0; i<hiddenLayers; i++){
         cv::Mat tempX;
         if(i == 0) trainX.copyTo(tempX); else Activations[Activations.size() - 1].copyTo(tempX);
         SA tmpsa;
-        trainSparseAutoencoder(tmpsa, tempX, 600, 3e-3, 0.1, 3, 2e-2, \
+        trainSparseAutoencoder(tmpsa, tempX, hiddenSize, 3e-3, 0.1, 3, 2e-2, \
                 maxTrainingIter);
         cv::Mat tmpacti = tmpsa.W1 * tempX + repeat(tmpsa.b1, 1, tempX.cols);
         tmpacti = sigmoid(tmpacti);
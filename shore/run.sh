@@ -35,12 +35,11 @@ sed -i -e "s#@NTHREADS#$THREADS#g" shore.conf
 
 # Run app
 TBENCH_QPS=${QPS} TBENCH_MAXREQS=${MAXREQS} TBENCH_WARMUPREQS=${WARMUPREQS} \
-    TBENCH_MINSLEEPNS=10000 chrt -r 99 ${BIN} -i cmdfile
+    TBENCH_MINSLEEPNS=10000 TBENCH_DUMP_RAW_LATS=1 chrt -r 99 ${BIN} -i cmdfile
 
 # Cleanup
 rm -f log scratch cmdfile db-tpcc-1 diskrw shore.conf info
 
-../utilities/parselats.py ./lats.bin
+../utilities/parselats ./lats.bin
 
 mv lats.bin lats.int.bin
-mv lats.txt lats.int.txt
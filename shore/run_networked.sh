@@ -39,7 +39,7 @@ echo $! > server.pid
 sleep 5
 
 # Launch Client
-TBENCH_QPS=${QPS} TBENCH_MINSLEEPNS=10000 \
+TBENCH_QPS=${QPS} TBENCH_MINSLEEPNS=10000 TBENCH_DUMP_RAW_LATS=1 \
      chrt -r 99 shore-kits/shore_kits_client_networked -i cmdfile &
 echo $! > client.pid
 
@@ -51,7 +51,6 @@ wait $(cat client.pid)
 rm -f log scratch cmdfile db-tpcc-1 diskrw shore.conf info server.pid \
     client.pid
 
-../utilities/parselats.py ./lats.bin
+../utilities/parselats ./lats.bin
 
 mv lats.bin lats.net.bin
-mv lats.txt lats.net.txt
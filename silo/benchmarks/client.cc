@@ -17,6 +17,7 @@ class Client {
         };
 
         static unsigned g_txn_workload_mix[5];
+        static const char* g_txn_names[5];
         static unsigned long seed;
         static Client* singleton;
 
@@ -39,6 +40,8 @@ class Client {
 
         static Client* getSingleton() { return singleton; }
 
+        static const char* txnName(ReqType type) { return g_txn_names[type]; }
+
         Request getReq() {
             Request req;
 
@@ -61,6 +64,8 @@ class Client {
  * Global State
  *******************************************************************************/
 unsigned Client::g_txn_workload_mix[] = { 45, 43, 4, 4, 4 }; // default TPC-C workload mix
+const char* Client::g_txn_names[] = { "NewOrder", "Payment", "Delivery", 
+    "OrderStatus", "StockLevel" };
 unsigned long Client::seed = 23984543;
 Client* Client::singleton = nullptr;
 
@@ -73,6 +78,7 @@ void tBenchClientInit() {
 
 size_t tBenchClientGenReq(void* data) {
     Request req = Client::getSingleton()->getReq();
+    tBenchClientSetReqClass(req.type, Client::txnName(req.type));
     memcpy(data, reinterpret_cast<const void*>(&req), sizeof(req));
     return sizeof(req);
 }
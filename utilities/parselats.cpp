@@ -0,0 +1,473 @@
+/** $lic$
+ * Copyright (C) 2016-2017 by Massachusetts Institute of Technology
+ *
+ * This file is part of TailBench.
+ *
+ * If you use this software in your research, we request that you reference the
+ * TaiBench paper ("TailBench: A Benchmark Suite and Evaluation Methodology for
+ * Latency-Critical Applications", Kasture and Sanchez, IISWC-2016) as the
+ * source in any publications that use this software, and that you send us a
+ * citation of your work.
+ *
+ * TailBench is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ */
+
+// Analyzes the raw latencies a client dumps with TBENCH_DUMP_RAW_LATS=1.
+// Reads lats.bin (and lats.classes.bin and lats.times.bin, if present next to
+// it) in a single pass through a memory map, into fixed-size histograms, so
+// memory use does not grow with the number of requests. Reports the
+// percentile ladder with bootstrap confidence intervals, and optionally
+// writes CDFs and a time series of the tail. Given two runs, compares them
+// and flags percentiles that changed by more than chance would explain.
+
+#include "hist.h"
+#include "tbench_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum Metric { QUEUE, SVC, SJRN }; // Column of lats.bin
+
+static const char* metricNames[] = { "queue", "service", "sojourn" };
+
+// Rows of the ladder; max gets no confidence interval, since resamples can
+// never exceed it
+static const double LADDER[] = { 50.0, 90.0, 95.0, 99.0, 99.9, 99.99 };
+static const int LADDER_LEN = sizeof(LADDER) / sizeof(LADDER[0]);
+
+struct Options {
+    Metric metric;
+    int resamples;
+    double minChangePct; // Smaller changes are never flagged
+    uint64_t seed;
+    std::string cdfPath;
+    std::string seriesPath;
+    uint64_t windowNs;
+
+    Options()
+        : metric(SJRN)
+        , resamples(1000)
+        , minChangePct(1.0)
+        , seed(0)
+        , windowNs(1000ULL * 1000 * 1000)
+    {}
+};
+
+// Maps a whole file read-only. Returns nullptr (and sets *len to 0) if it does
+// not exist and optional is set.
+static const char* mapFile(const std::string& path, size_t* len,
+        bool optional) {
+    *len = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (optional && errno == ENOENT) return nullptr;
+        std::cerr << "Could not open " << path << ": " << strerror(errno) \
+            << std::endl;
+        exit(-1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        std::cerr << "fstat() failed on " << path << ": " << strerror(errno) \
+            << std::endl;
+        exit(-1);
+    }
+
+    *len = st.st_size;
+    if (*len == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* base = mmap(nullptr, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "mmap() failed on " << path << ": " << strerror(errno) \
+            << std::endl;
+        exit(-1);
+    }
+    madvise(base, *len, MADV_SEQUENTIAL);
+    return reinterpret_cast<const char*>(base);
+}
+
+static std::string siblingPath(const std::string& path,
+        const std::string& name) {
+    size_t slash = path.rfind('/');
+    return (slash == std::string::npos) ? name :
+        path.substr(0, slash + 1) + name;
+}
+
+// One run's latencies of the selected metric, overall, per class (if tagged)
+// and per window of completion time (if asked for and lats.times.bin exists)
+struct Run {
+    std::string path;
+    uint64_t reqs;
+    Histogram all;
+    std::vector<Histogram*> classes; // nullptr if the class never shows up
+    std::map<uint64_t, Histogram*> windows; // By window index
+
+    Run(const std::string& path, const Options& opts)
+        : path(path)
+        , classes(TBENCH_MAX_REQ_CLASSES, nullptr)
+    {
+        size_t len, clsLen, timesLen;
+        const uint64_t* lats = reinterpret_cast<const uint64_t*>(
+                mapFile(path, &len, false));
+        if (len % (3 * sizeof(uint64_t))) {
+            std::cerr << path << " is not a whole number of <queue, " \
+                << "service, sojourn> tuples" << std::endl;
+            exit(-1);
+        }
+        reqs = len / (3 * sizeof(uint64_t));
+
+        const uint8_t* cls = reinterpret_cast<const uint8_t*>(
+                mapFile(siblingPath(path, "lats.classes.bin"), &clsLen, true));
+        if (cls && clsLen != reqs) {
+            std::cerr << "WARNING: lats.classes.bin does not match " << path \
+                << ", ignoring it" << std::endl;
+            cls = nullptr;
+        }
+
+        const uint64_t* times = nullptr;
+        if (!opts.seriesPath.empty()) {
+            times = reinterpret_cast<const uint64_t*>(mapFile(
+                        siblingPath(path, "lats.times.bin"), &timesLen, true));
+            if (!times || timesLen != reqs * sizeof(uint64_t)) {
+                std::cerr << "WARNING: No lats.times.bin matching " << path \
+                    << ", so no time series for it" << std::endl;
+                times = nullptr;
+            }
+        }
+
+        for (uint64_t r = 0; r < reqs; ++r) {
+            uint64_t v = lats[3 * r + opts.metric];
+            all.record(v);
+
+            if (cls) {
+                unsigned c = std::min<unsigned>(cls[r],
+                        TBENCH_MAX_REQ_CLASSES - 1);
+                if (!classes[c]) classes[c] = new Histogram();
+                classes[c]->record(v);
+            }
+
+            if (times) {
+                Histogram*& w = windows[times[r] / opts.windowNs];
+                if (!w) w = new Histogram();
+                w->record(v);
+            }
+        }
+
+        if (lats) munmap(const_cast<uint64_t*>(lats), len);
+        if (cls) munmap(const_cast<uint8_t*>(cls), clsLen);
+        if (times) munmap(const_cast<uint64_t*>(times), timesLen);
+    }
+};
+
+// Bootstrap distributions of the mean and of each ladder percentile:
+// stats[i][b] is row i (mean, then LADDER) of resample b
+typedef std::vector<std::vector<double>> BootStats;
+
+static BootStats bootstrap(const Histogram& hist, const Options& opts) {
+    BootStats stats(LADDER_LEN + 1);
+    std::mt19937_64 gen(opts.seed);
+    Histogram* res = new Histogram();
+    for (int b = 0; b < opts.resamples; ++b) {
+        hist.resample(gen, res);
+        stats[0].push_back(res->mean());
+        for (int i = 0; i < LADDER_LEN; ++i) {
+            stats[i + 1].push_back(res->percentile(LADDER[i]));
+        }
+    }
+    delete res;
+    return stats;
+}
+
+// Value at quantile q (0-1) of sorted
+static double quantile(const std::vector<double>& sorted, double q) {
+    size_t i = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[i];
+}
+
+// Mean of the bucket midpoints. Resamples only know which bucket each value
+// fell in, so this, not the exact mean, is what their means scatter around.
+static double midpointMean(const Histogram& hist) {
+    double sum = 0.0;
+    hist.forEachBucket([&sum](uint64_t low, uint64_t high, uint64_t n) {
+        sum += n * (double)(low + (high - low) / 2);
+    });
+    return hist.count() ? sum / hist.count() : 0.0;
+}
+
+static double pointStat(const Histogram& hist, int row) {
+    return row ? hist.percentile(LADDER[row - 1]) : midpointMean(hist);
+}
+
+static std::string rowName(int row) {
+    if (row == 0) return "mean";
+    std::stringstream ss;
+    ss << "p" << LADDER[row - 1];
+    return ss.str();
+}
+
+static void printLadder(const std::string& title, const Histogram& hist,
+        const Options& opts) {
+    std::cout << "# " << title << std::endl;
+    std::cout << std::setw(8) << "" << std::setw(14) << "value";
+    if (opts.resamples) {
+        std::cout << std::setw(14) << "ci_low" << std::setw(14) << "ci_high";
+    }
+    std::cout << std::endl;
+
+    BootStats boot;
+    if (opts.resamples) boot = bootstrap(hist, opts);
+
+    std::cout << std::fixed << std::setprecision(0);
+    for (int row = 0; row <= LADDER_LEN; ++row) {
+        std::cout << std::setw(8) << rowName(row) << std::setw(14) \
+            << pointStat(hist, row);
+        if (opts.resamples) {
+            std::sort(boot[row].begin(), boot[row].end());
+            std::cout << std::setw(14) << quantile(boot[row], 0.025) \
+                << std::setw(14) << quantile(boot[row], 0.975);
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::setw(8) << "max" << std::setw(14) << hist.max() \
+        << std::endl << std::endl;
+}
+
+// Prints how each ladder row changed from base to cur, with a bootstrap
+// confidence interval of the change. Returns the number of rows flagged as
+// regressions.
+static int printComparison(const std::string& title, const Histogram& base,
+        const Histogram& cur, const Options& opts) {
+    std::cout << "# " << title << std::endl;
+    std::cout << std::setw(8) << "" << std::setw(14) << "base" \
+        << std::setw(14) << "new" << std::setw(10) << "change";
+    if (opts.resamples) {
+        std::cout << std::setw(10) << "ci_low" << std::setw(10) << "ci_high";
+    }
+    std::cout << std::endl;
+
+    BootStats baseBoot, curBoot;
+    if (opts.resamples) {
+        baseBoot = bootstrap(base, opts);
+        Options curOpts = opts;
+        curOpts.seed = opts.seed + 1; // Independent of base's resamples
+        curBoot = bootstrap(cur, curOpts);
+    }
+
+    int regressions = 0;
+    for (int row = 0; row <= LADDER_LEN; ++row) {
+        double b = pointStat(base, row);
+        double c = pointStat(cur, row);
+        double scale = b ? 100.0 / b : 0.0;
+
+        std::cout << std::fixed << std::setprecision(0) << std::setw(8) \
+            << rowName(row) << std::setw(14) << b << std::setw(14) << c \
+            << std::showpos << std::setprecision(2) << std::setw(9) \
+            << (c - b) * scale << "%";
+
+        if (opts.resamples) {
+            std::vector<double> diffs;
+            for (int r = 0; r < opts.resamples; ++r) {
+                diffs.push_back(curBoot[row][r] - baseBoot[row][r]);
+            }
+            std::sort(diffs.begin(), diffs.end());
+            double lo = quantile(diffs, 0.025) * scale;
+            double hi = quantile(diffs, 0.975) * scale;
+            std::cout << std::setw(9) << lo << "%" << std::setw(9) << hi \
+                << "%";
+
+            // Significant if the interval excludes no change, and large
+            // enough to matter
+            if (lo > 0 && (c - b) * scale >= opts.minChangePct) {
+                std::cout << "  REGRESSION";
+                ++regressions;
+            } else if (hi < 0 && (b - c) * scale >= opts.minChangePct) {
+                std::cout << "  improvement";
+            }
+        }
+        std::cout << std::noshowpos << std::endl;
+    }
+    std::cout << std::endl;
+
+    return regressions;
+}
+
+static void writeCdfs(const std::vector<Run*>& runs, const Options& opts) {
+    std::ofstream out(opts.cdfPath.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Could not open " << opts.cdfPath << std::endl;
+        exit(-1);
+    }
+
+    // One row per histogram bucket, at its upper end
+    out << "run,latency_ns,cdf" << std::endl;
+    out << std::setprecision(9);
+    for (Run* run : runs) {
+        uint64_t seen = 0;
+        uint64_t total = run->all.count();
+        run->all.forEachBucket([&](uint64_t, uint64_t high, uint64_t n) {
+                seen += n;
+                out << run->path << "," << high << "," \
+                    << (double)seen / total << std::endl;
+            });
+    }
+}
+
+static void writeSeries(const std::vector<Run*>& runs, const Options& opts) {
+    std::ofstream out(opts.seriesPath.c_str());
+    if (!out.is_open()) {
+        std::cerr << "Could not open " << opts.seriesPath << std::endl;
+        exit(-1);
+    }
+
+    // Windows are by completion time from the start of the ROI
+    out << "run,start_s,qps,p50_ns,p99_ns,p999_ns,max_ns" << std::endl;
+    double windowS = opts.windowNs / 1e9;
+    for (Run* run : runs) {
+        for (auto& w : run->windows) {
+            const Histogram* h = w.second;
+            out << std::fixed << run->path << "," << std::setprecision(3) \
+                << w.first * windowS << "," << std::setprecision(1) \
+                << h->count() / windowS << "," << h->percentile(50.0) \
+                << "," << h->percentile(99.0) << "," \
+                << h->percentile(99.9) << "," << h->max() << std::endl;
+        }
+    }
+}
+
+static void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options] lats.bin [new/lats.bin]\n" \
+        << "With one file, prints its percentiles with 95% confidence\n" \
+        << "intervals; with two, compares the second against the first.\n" \
+        << "  -m queue|svc|sjrn  Latency to analyze (default sjrn)\n" \
+        << "  -b N               Bootstrap resamples (default 1000, 0 = no\n" \
+        << "                     confidence intervals)\n" \
+        << "  -t PCT             Only flag changes of at least PCT% (default\n" \
+        << "                     1, the histograms' resolution)\n" \
+        << "  -r SEED            Bootstrap random seed (default 0)\n" \
+        << "  -c FILE            Write CDFs to FILE (CSV)\n" \
+        << "  -s FILE            Write the tail over time to FILE (CSV);\n" \
+        << "                     needs lats.times.bin\n" \
+        << "  -w MS              Time series window (default 1000)\n" \
+        << "Exits with status 1 if the comparison finds a regression." \
+        << std::endl;
+    exit(-1);
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:b:t:r:c:s:w:h")) != -1) {
+        switch (c) {
+            case 'm':
+                if (!strcmp(optarg, "queue")) opts.metric = QUEUE;
+                else if (!strcmp(optarg, "svc")) opts.metric = SVC;
+                else if (!strcmp(optarg, "sjrn")) opts.metric = SJRN;
+                else usage(argv[0]);
+                break;
+            case 'b':
+                opts.resamples = atoi(optarg);
+                break;
+            case 't':
+                opts.minChangePct = atof(optarg);
+                break;
+            case 'r':
+                opts.seed = strtoull(optarg, nullptr, 10);
+                break;
+            case 'c':
+                opts.cdfPath = optarg;
+                break;
+            case 's':
+                opts.seriesPath = optarg;
+                break;
+            case 'w':
+                opts.windowNs = strtoull(optarg, nullptr, 10) * 1000 * 1000;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    int nfiles = argc - optind;
+    if (nfiles < 1 || nfiles > 2 || opts.resamples < 0 || !opts.windowNs) {
+        usage(argv[0]);
+    }
+
+    std::vector<Run*> runs;
+    for (int f = optind; f < argc; ++f) runs.push_back(new Run(argv[f], opts));
+
+    std::string unit = std::string(metricNames[opts.metric]) +
+        " times in ns";
+    int regressions = 0;
+
+    if (nfiles == 1) {
+        Run* run = runs[0];
+        std::stringstream title;
+        title << run->path << ": " << unit << " of " << run->reqs \
+            << " requests";
+        if (opts.resamples) {
+            title << ", 95% CIs from " << opts.resamples << " resamples";
+        }
+        printLadder(title.str(), run->all, opts);
+
+        for (int cls = 0; cls < TBENCH_MAX_REQ_CLASSES; ++cls) {
+            if (!run->classes[cls]) continue;
+            std::stringstream ct;
+            ct << "Class " << cls << ": " << run->classes[cls]->count() \
+                << " requests";
+            printLadder(ct.str(), *run->classes[cls], opts);
+        }
+    } else {
+        Run* base = runs[0];
+        Run* cur = runs[1];
+        std::stringstream title;
+        title << unit << ", " << cur->path << " (" << cur->reqs \
+            << " requests) against " << base->path << " (" << base->reqs \
+            << " requests)";
+        if (opts.resamples) title << ", 95% CIs of the change";
+        regressions += printComparison(title.str(), base->all, cur->all, opts);
+
+        for (int cls = 0; cls < TBENCH_MAX_REQ_CLASSES; ++cls) {
+            if (!base->classes[cls] || !cur->classes[cls]) continue;
+            std::stringstream ct;
+            ct << "Class " << cls;
+            regressions += printComparison(ct.str(), *base->classes[cls],
+                    *cur->classes[cls], opts);
+        }
+
+        if (regressions) {
+            std::cout << regressions << " significant regression(s)" \
+                << std::endl;
+        } else {
+            std::cout << "No significant regressions" << std::endl;
+        }
+    }
+
+    if (!opts.cdfPath.empty()) writeCdfs(runs, opts);
+    if (!opts.seriesPath.empty()) writeSeries(runs, opts);
+
+    return regressions ? 1 : 0;
+}